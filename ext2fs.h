@@ -63,6 +63,11 @@
 #define _UFS_EXT2FS_EXT2FS_H_
 
 #include <sys/bswap.h>
+#include <sys/ioccom.h>
+#include <sys/condvar.h>
+#include <sys/mutex.h>
+#include <sys/queue.h>
+#include <sys/rbtree.h>
 
 /*
  * Each disk drive contains some number of file systems.
@@ -237,6 +242,70 @@ struct ext2fs {
 
 
 /* in-memory data for ext2fs */
+/*
+ * In-memory state of one block group, see ext2fs_alloc.c.
+ *
+ * The buddy keeps one free map per order k: bit i is set when the
+ * 2^k blocks starting at group block i << k are all free.  It is
+ * built from the on-disk bitmap the first time the group is allocated
+ * from and afterwards updated along with it.  Only the buddies of the
+ * most recently allocated from groups are kept, see ext2fs_buddy_enter().
+ *
+ * ci_busy is the group lock, held by whoever allocates from or frees
+ * to the group across the reading of its bitmap, see ext2fs_cg_enter().
+ * It covers the bitmaps, the group descriptor and the buddy.
+ *
+ * The bitmaps of recently used groups may be kept in memory instead of
+ * the buffer cache, see ext2fs_bitmap_get().
+ *
+ * Groups are also kept on summary lists by the order of their largest
+ * free chunk, taken from the buddy once built and estimated from the
+ * free block count until then, see ext2fs_sum_update().
+ */
+#define	EXT2FS_BUDDY_MAXORDER	19	/* 8 * 64k blocks per group */
+
+struct ext2fs_cginfo {
+	uint64_t *ci_buddy;	/* free maps, NULL until built */
+	int32_t	ci_nblk;	/* blocks in this group */
+	int32_t	ci_count[EXT2FS_BUDDY_MAXORDER + 1]; /* set bits per order */
+	kmutex_t ci_lock;	/* protects ci_busy */
+	kcondvar_t ci_cv;	/* wait for ci_busy to clear */
+	bool	ci_busy;	/* group locked */
+	char	*ci_bitmap[2];	/* cached block and inode bitmaps, or NULL */
+	bool	ci_bmdirty[2];	/* cached bitmap not written back */
+	bool	ci_cached;	/* on the bitmap cache LRU list */
+	TAILQ_ENTRY(ext2fs_cginfo) ci_lru; /* bitmap cache LRU list */
+	TAILQ_ENTRY(ext2fs_cginfo) ci_blru; /* buddy LRU list */
+	int32_t	ci_sumorder;	/* summary list, -1 if full */
+	TAILQ_ENTRY(ext2fs_cginfo) ci_sum; /* summary list */
+};
+
+#define	EXT2FS_BBITMAP	0	/* block bitmap */
+#define	EXT2FS_IBITMAP	1	/* inode bitmap */
+
+/*
+ * Free block and inode counts not yet folded into the superblock by
+ * one CPU, up to EXT2FS_PCPU_BATCH either way.
+ */
+struct ext2fs_pcpu {
+	int32_t	pc_nbfree;
+	int32_t	pc_nifree;
+};
+
+#define	EXT2FS_PCPU_BATCH	256
+
+/*
+ * Free space of a flex group: 2^e2fs_flexshift consecutive groups whose
+ * bitmaps and inode tables mke2fs packs at the start of the first one.
+ * Without flex_bg each group is a flex group of its own.  Kept up to
+ * date along with the group descriptors, with atomic operations.
+ */
+struct ext2fs_flexinfo {
+	uint32_t fi_nbfree;	/* free blocks */
+	uint32_t fi_nifree;	/* free inodes */
+	uint32_t fi_ndirs;	/* directories */
+};
+
 struct m_ext2fs {
 	struct ext2fs e2fs;
 	u_char	e2fs_fsmnt[MAXMNTLEN];	/* name mounted on */
@@ -253,6 +322,65 @@ struct m_ext2fs {
 	int32_t	e2fs_ipb;	/* number of inodes per block */
 	int32_t	e2fs_itpg;	/* number of inode table blocks per group */
 	struct	ext2_gd *e2fs_gd; /* group descriptors (data not byteswapped) */
+	struct	ext2fs_cginfo *e2fs_cginfo; /* in-memory per group state */
+	struct	ext2fs_flexinfo *e2fs_flexinfo; /* per flex group totals */
+	int32_t	e2fs_flexshift;	/* log2 of groups per flex group */
+	int32_t	e2fs_nflex;	/* number of flex groups */
+	kmutex_t e2fs_lock;	/* protects e2fs_dablocks */
+	struct	percpu *e2fs_pcpu; /* struct ext2fs_pcpu, see ext2fs_alloc.c */
+	kmutex_t e2fs_bmlock;	/* protects the bitmap cache and buddy LRU lists */
+	TAILQ_HEAD(ext2fs_cginfo_lru, ext2fs_cginfo) e2fs_bmlru; /* most recently used first */
+	int32_t	e2fs_bmcount;	/* groups in the bitmap cache */
+	struct	ext2fs_cginfo_lru e2fs_buddylru; /* most recently used first */
+	int32_t	e2fs_buddycount; /* groups with a buddy */
+	kmutex_t e2fs_sumlock;	/* protects the summary lists */
+	TAILQ_HEAD(ext2fs_cginfo_sum, ext2fs_cginfo)
+		e2fs_sum[EXT2FS_BUDDY_MAXORDER + 1]; /* groups by largest chunk */
+	uint32_t e2fs_dablocks;	/* blocks reserved by delayed allocation */
+	kmutex_t e2fs_rsvlock;	/* protects the reservation windows */
+	rb_tree_t e2fs_rsvtree;	/* reservation windows by first block */
+	int32_t	e2fs_buddy_order; /* highest buddy order */
+	int32_t	e2fs_buddy_words; /* 64-bit words in one group's buddy */
+	int32_t	e2fs_buddy_off[EXT2FS_BUDDY_MAXORDER + 1]; /* per order */
+	struct	ext2fs_dcq *e2fs_dcq; /* online discard, NULL if not enabled */
+	struct	ext2fs_itinit *e2fs_itinit; /* inode table zeroing, or NULL */
+};
+
+/*
+ * One run of a file's logical to physical block mapping,
+ * see ext2fs_bmap_range().
+ */
+struct ext2fs_map_run {
+	daddr_t	mr_lbn;		/* first logical block */
+	daddr_t	mr_pbn;		/* first file system block, 0 for holes */
+	daddr_t	mr_len;		/* length in blocks */
+	int	mr_flags;
+};
+
+#define	EXT2FS_MAP_HOLE		0x01	/* not allocated */
+#define	EXT2FS_MAP_UNWRITTEN	0x02	/* allocated, reads as zeroes */
+
+/*
+ * Blocks released by a truncate, collected as runs and returned to
+ * the bitmaps a group at a time by ext2fs_freelist_flush().  A full
+ * list is flushed when the next run is added, unless fl_sync is set:
+ * then the caller has to write out what maps the runs and flush the
+ * list itself before it fills up.
+ */
+#define	EXT2FS_FREELIST_MAX	32
+
+#define	ext2fs_freelist_full(fl)	((fl)->fl_nrun == EXT2FS_FREELIST_MAX)
+
+struct ext2fs_freelist {
+	struct inode *fl_ip;		/* owner, NULL in the discard worker */
+	struct m_ext2fs *fl_fs;
+	struct vnode *fl_devvp;
+	bool	fl_sync;		/* write fl_ip out before releasing */
+	int	fl_nrun;		/* runs in use */
+	struct ext2fs_freerun {
+		daddr_t	fr_bno;		/* first block */
+		daddr_t	fr_len;		/* length in blocks */
+	} fl_run[EXT2FS_FREELIST_MAX];
 };
 
 
@@ -523,6 +651,13 @@ void e2fs_sb_bswap(struct ext2fs *, struct ext2fs *);
 #define	dtogd(fs, d) \
 	(((d) - (fs)->e2fs.e2fs_first_dblock) % (fs)->e2fs.e2fs_fpg)
 
+/*
+ * Give flex group number for a cylinder group.
+ * Give first cylinder group of a flex group.
+ */
+#define	cg_to_flex(fs, cg)	((cg) >> (fs)->e2fs_flexshift)
+#define	flex_to_cg(fs, flex)	((flex) << (fs)->e2fs_flexshift)
+
 /*
  * The following macros optimize certain frequently calculated
  * quantities by using shifts and masks in place of divisions
@@ -550,4 +685,52 @@ void e2fs_sb_bswap(struct ext2fs *, struct ext2fs *);
  */
 #define	EXT2_NINDIR(fs)	((fs)->e2fs_bsize / sizeof(uint32_t))
 
+/*
+ * File layout reporting, after the Linux FIEMAP ioctl but not binary
+ * compatible with it: fm_extents points to the caller's array instead
+ * of following the header, and holes are reported as entries of their
+ * own, flagged with a bit Linux does not use.  The caller fills in the
+ * byte range and an array of fm_extent_count entries; on return
+ * fm_mapped_extents entries describe the range.  With fm_extent_count
+ * set to 0 only the number of entries is returned.  The other flags
+ * have their Linux values.
+ */
+struct ext2fs_fiemap_extent {
+	uint64_t fe_logical;	/* byte offset in the file */
+	uint64_t fe_physical;	/* byte offset on the device, 0 for holes */
+	uint64_t fe_length;	/* length in bytes */
+	uint32_t fe_flags;
+	uint32_t fe_reserved;
+};
+
+#define	EXT2FS_FIEMAP_EXTENT_LAST	0x0001	/* last entry of the file */
+#define	EXT2FS_FIEMAP_EXTENT_UNWRITTEN	0x0800	/* allocated, reads as 0 */
+#define	EXT2FS_FIEMAP_EXTENT_HOLE	0x80000000 /* not allocated */
+
+struct ext2fs_fiemap {
+	uint64_t fm_start;		/* in: first byte */
+	uint64_t fm_length;		/* in: number of bytes */
+	uint32_t fm_flags;		/* in: must be 0 */
+	uint32_t fm_mapped_extents;	/* out: entries filled in */
+	uint32_t fm_extent_count;	/* in: size of fm_extents */
+	uint32_t fm_reserved;
+	struct ext2fs_fiemap_extent *fm_extents;
+};
+
+#define	EXT2FS_IOC_FIEMAP	_IOWR('e', 1, struct ext2fs_fiemap)
+
+/*
+ * Free space discard, modelled on the Linux FITRIM ioctl.  Free runs
+ * of at least minlen bytes in the byte range [start, start + len) of
+ * the file system are discarded; on return len holds the number of
+ * bytes discarded.
+ */
+struct ext2fs_fstrim_range {
+	uint64_t start;		/* in: first byte */
+	uint64_t len;		/* in: number of bytes, out: bytes discarded */
+	uint64_t minlen;	/* in: smallest run worth discarding */
+};
+
+#define	EXT2FS_IOC_FITRIM	_IOWR('e', 2, struct ext2fs_fstrim_range)
+
 #endif /* !_UFS_EXT2FS_EXT2FS_H_ */
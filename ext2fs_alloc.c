@@ -64,6 +64,7 @@ __KERNEL_RCSID(0, "$NetBSD: ext2fs_alloc.c,v 1.52 2017/05/28 16:38:55 hannken Ex
 
 #include <sys/param.h>
 #include <sys/systm.h>
+#include <sys/bitops.h>
 #include <sys/buf.h>
 #include <sys/proc.h>
 #include <sys/vnode.h>
@@ -71,6 +72,15 @@ __KERNEL_RCSID(0, "$NetBSD: ext2fs_alloc.c,v 1.52 2017/05/28 16:38:55 hannken Ex
 #include <sys/kernel.h>
 #include <sys/syslog.h>
 #include <sys/kauth.h>
+#include <sys/kmem.h>
+#include <sys/cprng.h>
+#include <sys/cpu.h>
+#include <sys/atomic.h>
+#include <sys/percpu.h>
+#include <sys/xcall.h>
+#include <sys/callout.h>
+#include <sys/workqueue.h>
+#include <sys/kthread.h>
 
 #include <lib/libkern/crc16.h>
 
@@ -83,13 +93,100 @@ __KERNEL_RCSID(0, "$NetBSD: ext2fs_alloc.c,v 1.52 2017/05/28 16:38:55 hannken Ex
 
 u_long ext2gennumber;
 
-static daddr_t	ext2fs_alloccg(struct inode *, int, daddr_t, int);
-static u_long	ext2fs_dirpref(struct m_ext2fs *);
+/* largest reservation window in blocks, 0 to not reserve */
+int ext2fs_rsvmax = 1024;
+
+/* groups per mount whose bitmaps are kept in memory, 0 for none */
+int ext2fs_bmcache = 0;
+
+/* groups per mount whose buddy is kept, 0 for no limit */
+int ext2fs_buddymax = 128;
+
+/* groups ext2fs_hashalloc() takes from the summary, see ext2fs_sum_find() */
+#define	EXT2FS_SUM_TRIES	4
+
+/*
+ * Online discard state of a mount, see ext2fs_discard_queue().
+ */
+struct ext2fs_dcrun {
+	TAILQ_ENTRY(ext2fs_dcrun) dr_list;
+	daddr_t	dr_bno;			/* first block */
+	daddr_t	dr_len;			/* length in blocks */
+};
+
+struct ext2fs_dcq {
+	struct work	dq_work;	/* the worker, on dq_wq */
+	struct workqueue *dq_wq;
+	callout_t	dq_callout;	/* lets runs gather before the worker */
+	struct m_ext2fs	*dq_fs;
+	struct vnode	*dq_devvp;
+	kmutex_t	dq_lock;	/* protects the fields below */
+	kcondvar_t	dq_cv;		/* worker went idle */
+	TAILQ_HEAD(ext2fs_dcruns, ext2fs_dcrun) dq_runs; /* not yet discarded */
+	int		dq_state;	/* EXT2FS_DC_* */
+};
+
+#define	EXT2FS_DC_IDLE		0	/* nothing queued */
+#define	EXT2FS_DC_WAIT		1	/* callout pending */
+#define	EXT2FS_DC_RUN		2	/* worker queued or running */
+
+/* largest discard request, in bytes */
+#define	EXT2FS_DISCARD_MAX	(64 * 1024 * 1024)
+
+/* pause of the inode table zeroing thread after each group, in ms */
+int ext2fs_itinit_delay = 100;
+
+/*
+ * Inode table zeroing thread of a mount, see ext2fs_itinit_start().
+ */
+struct ext2fs_itinit {
+	struct lwp	*it_lwp;
+	struct m_ext2fs	*it_fs;
+	struct vnode	*it_devvp;
+	kmutex_t	it_lock;	/* protects it_stop */
+	kcondvar_t	it_cv;		/* it_stop set */
+	bool		it_stop;
+};
+
+/* whether a group's inode table may be allocated from */
+#define	ext2fs_itable_ready(fs, cg) \
+	(!E2FS_HAS_GD_CSUM(fs) || ((fs)->e2fs_gd[(cg)].ext2bgd_flags & \
+	    h2fs16(E2FS_BG_INODE_ZEROED)) != 0)
+
+static daddr_t	ext2fs_alloccg(struct inode *, int, daddr_t, int, int *);
+static u_long	ext2fs_dirpref(struct inode *);
 static void	ext2fs_fserr(struct m_ext2fs *, u_int, const char *);
-static u_long	ext2fs_hashalloc(struct inode *, int, long, int,
-		    daddr_t (*)(struct inode *, int, daddr_t, int));
-static daddr_t	ext2fs_nodealloccg(struct inode *, int, daddr_t, int);
-static daddr_t	ext2fs_mapsearch(struct m_ext2fs *, char *, daddr_t);
+static u_long	ext2fs_hashalloc(struct inode *, int, long, int, int *,
+		    daddr_t (*)(struct inode *, int, daddr_t, int, int *));
+static long	ext2fs_hashalloc_cg(struct inode *, int, long, int, int *,
+		    daddr_t (*)(struct inode *, int, daddr_t, int, int *),
+		    bool, int *);
+static bool	ext2fs_cg_enter(struct m_ext2fs *, int, bool);
+static void	ext2fs_cg_exit(struct m_ext2fs *, int);
+static int	ext2fs_bitmap_get(struct vnode *, struct m_ext2fs *, int, int,
+		    char **, struct buf **);
+static void	ext2fs_bitmap_put(struct m_ext2fs *, int, int, struct buf *);
+static daddr_t	ext2fs_nodealloccg(struct inode *, int, daddr_t, int, int *);
+static daddr_t	ext2fs_nodealloccg_zero(struct inode *, int, daddr_t, int,
+		    int *);
+static int	ext2fs_itable_zero(struct vnode *, struct m_ext2fs *, int);
+static void	ext2fs_buddy_enter(struct m_ext2fs *, struct ext2fs_cginfo *);
+static void	ext2fs_buddy_build(struct m_ext2fs *, struct ext2fs_cginfo *,
+		    const char *);
+static void	ext2fs_buddy_set(struct m_ext2fs *, struct ext2fs_cginfo *,
+		    int32_t, int32_t, int);
+static int32_t	ext2fs_buddy_find(struct m_ext2fs *, struct ext2fs_cginfo *,
+		    int32_t, int32_t, int32_t *);
+static int32_t	ext2fs_buddy_runlen(struct m_ext2fs *, struct ext2fs_cginfo *,
+		    int32_t, int32_t);
+static int32_t	ext2fs_rsv_alloc(struct inode *, int, struct ext2fs_cginfo *,
+		    int32_t, int32_t, int32_t *);
+static void	ext2fs_flex_sum(struct m_ext2fs *);
+static void	ext2fs_sum_update(struct m_ext2fs *, int);
+static int	ext2fs_sum_find(struct m_ext2fs *, int);
+static void	ext2fs_count_add(struct m_ext2fs *, int, int);
+static void	ext2fs_freelist_release(struct ext2fs_freelist *);
+static void	ext2fs_discard_queue(struct m_ext2fs *, daddr_t, daddr_t);
 static __inline void	ext2fs_cg_update(struct m_ext2fs *, int, struct ext2_gd *, int, int, int, daddr_t);
 static uint16_t 	ext2fs_cg_get_csum(struct m_ext2fs *, int, struct ext2_gd *);
 static void		ext2fs_init_bb(struct m_ext2fs *, int, struct ext2_gd *, char *);
@@ -114,35 +211,73 @@ static void		ext2fs_init_bb(struct m_ext2fs *, int, struct ext2_gd *, char *);
 int
 ext2fs_alloc(struct inode *ip, daddr_t lbn, daddr_t bpref,
     kauth_cred_t cred, daddr_t *bnp)
+{
+	daddr_t len;
+
+	return ext2fs_alloc_range(ip, lbn, bpref, 1, cred, bnp, &len);
+}
+
+/*
+ * Allocate a run of up to len contiguous blocks.
+ *
+ * The first group is chosen as in ext2fs_alloc().  Within it the run
+ * starts at the preferred block when that is free and enough blocks
+ * follow it, and otherwise at the nearest free space long enough for
+ * the whole run, or the longest the group has.  The bitmap, the group
+ * descriptor and the free block count are updated once for the run.
+ * On success *bnp is the first block and *lenp the number of blocks
+ * allocated, at least one.
+ */
+int
+ext2fs_alloc_range(struct inode *ip, daddr_t lbn, daddr_t bpref,
+    daddr_t len, kauth_cred_t cred, daddr_t *bnp, daddr_t *lenp)
 {
 	struct m_ext2fs *fs;
 	daddr_t bno;
-	int cg;
+	int64_t nbfree;
+	int cg, n;
 
 	*bnp = 0;
+	*lenp = 0;
 	fs = ip->i_e2fs;
 #ifdef DIAGNOSTIC
 	if (cred == NOCRED)
 		panic("ext2fs_alloc: missing credential");
+	if (len <= 0)
+		panic("ext2fs_alloc_range: bad length %lld", (long long)len);
 #endif /* DIAGNOSTIC */
-	if (fs->e2fs.e2fs_fbcount == 0)
+	/* blocks reserved by delayed allocation are not free */
+	nbfree = ext2fs_count_nbfree(fs,
+	    (int64_t)fs->e2fs.e2fs_rbcount + fs->e2fs_dablocks + len);
+	if (nbfree <= fs->e2fs_dablocks)
 		goto nospace;
 	if (kauth_authorize_system(cred, KAUTH_SYSTEM_FS_RESERVEDSPACE, 0, NULL,
-	    NULL, NULL) != 0 &&
-	    freespace(fs) <= 0)
-		goto nospace;
+	    NULL, NULL) != 0) {
+		if (nbfree <= (int64_t)fs->e2fs.e2fs_rbcount + fs->e2fs_dablocks)
+			goto nospace;
+		len = MIN(len,
+		    nbfree - fs->e2fs.e2fs_rbcount - fs->e2fs_dablocks);
+	}
+	len = MIN(len, nbfree - fs->e2fs_dablocks);
+	len = MIN(len, fs->e2fs.e2fs_fpg);
 	if (bpref >= fs->e2fs.e2fs_bcount)
 		bpref = 0;
 	if (bpref == 0)
 		cg = ino_to_cg(fs, ip->i_number);
 	else
 		cg = dtog(fs, bpref);
-	bno = (daddr_t)ext2fs_hashalloc(ip, cg, bpref, fs->e2fs_bsize,
+	bno = (daddr_t)ext2fs_hashalloc(ip, cg, bpref, (int)len, &n,
 	    ext2fs_alloccg);
 	if (bno > 0) {
-		ext2fs_setnblock(ip, ext2fs_nblock(ip) + btodb(fs->e2fs_bsize));
+		if (ext2fs_setnblock(ip,
+		    ext2fs_nblock(ip) + (uint64_t)n * btodb(fs->e2fs_bsize)) != 0) {
+			/* i_blocks cannot count it without huge_file */
+			ext2fs_blkfree_range(ip, bno, n);
+			return EFBIG;
+		}
 		ip->i_flag |= IN_CHANGE | IN_UPDATE;
 		*bnp = bno;
+		*lenp = n;
 		return 0;
 	}
 nospace:
@@ -176,15 +311,20 @@ ext2fs_valloc(struct vnode *pvp, int mode, kauth_cred_t cred, ino_t *inop)
 
 	pip = VTOI(pvp);
 	fs = pip->i_e2fs;
-	if (fs->e2fs.e2fs_ficount == 0)
+	if (ext2fs_count_nifree(fs, 0) <= 0)
 		goto noinodes;
 
 	if ((mode & IFMT) == IFDIR)
-		cg = ext2fs_dirpref(fs);
+		cg = ext2fs_dirpref(pip);
 	else
 		cg = ino_to_cg(fs, pip->i_number);
 	ipref = cg * fs->e2fs.e2fs_ipg + 1;
-	ino = (ino_t)ext2fs_hashalloc(pip, cg, (long)ipref, mode, ext2fs_nodealloccg);
+	ino = (ino_t)ext2fs_hashalloc(pip, cg, (long)ipref, mode, NULL,
+	    ext2fs_nodealloccg);
+	/* only groups whose inode table is not zeroed yet are left */
+	if (ino == 0)
+		ino = (ino_t)ext2fs_hashalloc(pip, cg, (long)ipref, mode,
+		    NULL, ext2fs_nodealloccg_zero);
 	if (ino == 0)
 		goto noinodes;
 
@@ -198,28 +338,100 @@ noinodes:
 }
 
 /*
- * Find a cylinder to place a directory.
+ * Find a cylinder group to place a directory, after the Orlov
+ * allocator, with flex groups as the unit of placement.
+ *
+ * Top level directories, those made in the root or in a directory
+ * flagged EXT2_TOPDIR, are spread out: among the flex groups with at
+ * least the average number of free inodes and blocks, the one with the
+ * fewest directories.  The search starts at a random flex group so
+ * that ties do not all go to the first one.
+ *
+ * Other directories stay near their parent, in the first flex group
+ * from the parent's on that is neither saturated with directories nor
+ * short of free inodes or blocks.  Failing that, the first one with
+ * above average free inodes, and then any one with a free inode.
  *
- * The policy implemented by this algorithm is to select from
- * among those cylinder groups with above the average number of
- * free inodes, the one with the smallest number of directories.
+ * The directory goes in the first group of the chosen flex group that
+ * has a free inode, preferably one whose inode table is zeroed.
  */
 static u_long
-ext2fs_dirpref(struct m_ext2fs *fs)
+ext2fs_dirpref(struct inode *pip)
 {
-	int cg, maxspace, mincg, avgifree;
+	struct m_ext2fs *fs;
+	struct ext2fs_flexinfo *fi;
+	uint32_t avgifree, avgbfree, minifree, minbfree, maxndirs, ndirs;
+	uint32_t ipf, bpf;
+	int nflex, pflex, flex, best, i, cg, last;
 
-	avgifree = fs->e2fs.e2fs_ficount / fs->e2fs_ncg;
-	maxspace = 0;
-	mincg = -1;
-	for (cg = 0; cg < fs->e2fs_ncg; cg++)
-		if (fs2h16(fs->e2fs_gd[cg].ext2bgd_nifree) >= avgifree) {
-			if (mincg == -1 || fs2h16(fs->e2fs_gd[cg].ext2bgd_nbfree) > maxspace) {
-				mincg = cg;
-				maxspace = fs2h16(fs->e2fs_gd[cg].ext2bgd_nbfree);
-			}
+	fs = pip->i_e2fs;
+	nflex = fs->e2fs_nflex;
+	avgifree = fs->e2fs.e2fs_ficount / nflex;
+	avgbfree = fs->e2fs.e2fs_fbcount / nflex;
+	pflex = cg_to_flex(fs, ino_to_cg(fs, pip->i_number));
+	best = -1;
+
+	if (pip->i_number == EXT2_ROOTINO ||
+	    (pip->i_e2fs_flags & EXT2_TOPDIR) != 0) {
+		flex = cprng_fast32() % nflex;
+		for (i = 0; i < nflex; i++, flex = (flex + 1) % nflex) {
+			fi = &fs->e2fs_flexinfo[flex];
+			if (fi->fi_nifree < avgifree ||
+			    fi->fi_nbfree < avgbfree)
+				continue;
+			if (best == -1 ||
+			    fi->fi_ndirs < fs->e2fs_flexinfo[best].fi_ndirs)
+				best = flex;
+		}
+		if (best != -1)
+			goto found;
+		goto fallback;
+	}
+
+	for (ndirs = 0, flex = 0; flex < nflex; flex++)
+		ndirs += fs->e2fs_flexinfo[flex].fi_ndirs;
+	ipf = fs->e2fs.e2fs_ipg << fs->e2fs_flexshift;
+	bpf = fs->e2fs.e2fs_bpg << fs->e2fs_flexshift;
+	maxndirs = ndirs / nflex + ipf / 16;
+	minifree = avgifree > ipf / 4 ? avgifree - ipf / 4 : 1;
+	minbfree = avgbfree > bpf / 4 ? avgbfree - bpf / 4 : 0;
+	for (i = 0; i < nflex; i++) {
+		flex = (pflex + i) % nflex;
+		fi = &fs->e2fs_flexinfo[flex];
+		if (fi->fi_ndirs < maxndirs && fi->fi_nifree >= minifree &&
+		    fi->fi_nbfree >= minbfree) {
+			best = flex;
+			goto found;
+		}
+	}
+
+fallback:
+	for (i = 0; i < nflex; i++) {
+		flex = (pflex + i) % nflex;
+		if (fs->e2fs_flexinfo[flex].fi_nifree >= MAX(avgifree, 1)) {
+			best = flex;
+			goto found;
+		}
+	}
+	for (i = 0; i < nflex; i++) {
+		flex = (pflex + i) % nflex;
+		if (fs->e2fs_flexinfo[flex].fi_nifree != 0) {
+			best = flex;
+			goto found;
 		}
-	return mincg;
+	}
+	return ino_to_cg(fs, pip->i_number);
+
+found:
+	last = MIN(flex_to_cg(fs, best + 1), fs->e2fs_ncg);
+	for (cg = flex_to_cg(fs, best); cg < last; cg++)
+		if (fs->e2fs_gd[cg].ext2bgd_nifree != 0 &&
+		    ext2fs_itable_ready(fs, cg))
+			return cg;
+	for (cg = flex_to_cg(fs, best); cg < last; cg++)
+		if (fs->e2fs_gd[cg].ext2bgd_nifree != 0)
+			return cg;
+	return flex_to_cg(fs, best);
 }
 
 /*
@@ -263,9 +475,21 @@ ext2fs_blkpref(struct inode *ip, daddr_t lbn, int indx,
 		}
 	}
 
-	/* fall back to the first block of the cylinder containing the inode */
+	/*
+	 * fall back to the first block of the cylinder containing the
+	 * inode.  With flex_bg, the first group of the flex group holds
+	 * the bitmaps and inode tables of all of them, so start there,
+	 * next to the metadata, and put the data of regular files in the
+	 * second group when the flex group is large enough to spare it.
+	 */
 
 	cg = ino_to_cg(fs, ip->i_number);
+	if (fs->e2fs_flexshift > 0) {
+		cg = flex_to_cg(fs, cg_to_flex(fs, cg));
+		if ((ip->i_e2fs_mode & IFMT) == IFREG &&
+		    fs->e2fs_flexshift >= 2 && cg + 1 < fs->e2fs_ncg)
+			cg++;
+	}
 	return fs->e2fs.e2fs_bpg * cg + fs->e2fs.e2fs_first_dblock + 1;
 }
 
@@ -278,74 +502,183 @@ ext2fs_blkpref(struct inode *ip, daddr_t lbn, int indx,
  *   3) brute force search for a free block.
  */
 static u_long
-ext2fs_hashalloc(struct inode *ip, int cg, long pref, int size,
-		daddr_t (*allocator)(struct inode *, int, daddr_t, int))
+ext2fs_hashalloc(struct inode *ip, int cg, long pref, int size, int *lenp,
+		daddr_t (*allocator)(struct inode *, int, daddr_t, int, int *))
 {
 	struct m_ext2fs *fs;
+	struct ext2fs_flexinfo *fi;
 	long result;
-	int i, icg = cg;
+	int i, first, mask, pass, busy, icg = cg;
+	bool nowait;
 
 	fs = ip->i_e2fs;
 	/*
-	 * 1: preferred cylinder group
+	 * The first pass skips groups someone else is allocating from or
+	 * freeing to, so that concurrent allocations spread out rather
+	 * than queue up on one group; should that find nothing, the second
+	 * pass waits for the busy groups.
 	 */
-	result = (*allocator)(ip, cg, pref, size);
-	if (result)
-		return result;
-	/*
-	 * 2: quadratic rehash
-	 */
-	for (i = 1; i < fs->e2fs_ncg; i *= 2) {
-		cg += i;
-		if (cg >= fs->e2fs_ncg)
-			cg -= fs->e2fs_ncg;
-		result = (*allocator)(ip, cg, 0, size);
-		if (result)
-			return result;
-	}
-	/*
-	 * 3: brute force search
-	 * Note that we start at i == 2, since 0 was checked initially,
-	 * and 1 is always checked in the quadratic rehash.
-	 */
-	cg = (icg + 2) % fs->e2fs_ncg;
-	for (i = 2; i < fs->e2fs_ncg; i++) {
-		result = (*allocator)(ip, cg, 0, size);
+	for (pass = 0; pass < 2; pass++) {
+		nowait = pass == 0;
+		busy = 0;
+		cg = icg;
+		/*
+		 * 1: preferred cylinder group
+		 */
+		result = ext2fs_hashalloc_cg(ip, cg, pref, size, lenp,
+		    allocator, nowait, &busy);
 		if (result)
 			return result;
-		cg++;
-		if (cg == fs->e2fs_ncg)
-			cg = 0;
+		/*
+		 * 1a: the rest of its flex group, if that has anything free
+		 */
+		mask = (1 << fs->e2fs_flexshift) - 1;
+		fi = &fs->e2fs_flexinfo[cg_to_flex(fs, icg)];
+		if (mask != 0 && (allocator == ext2fs_alloccg ?
+		    fi->fi_nbfree : fi->fi_nifree) != 0) {
+			first = icg & ~mask;
+			for (i = 1; i <= mask; i++) {
+				cg = first + ((icg + i) & mask);
+				if (cg >= fs->e2fs_ncg)
+					continue;
+				result = ext2fs_hashalloc_cg(ip, cg, 0, size,
+				    lenp, allocator, nowait, &busy);
+				if (result)
+					return result;
+			}
+			cg = icg;
+		}
+		/*
+		 * 2: for blocks, the groups with the longest free runs
+		 * according to the summary
+		 */
+		if (allocator == ext2fs_alloccg) {
+			for (i = 0; i < EXT2FS_SUM_TRIES; i++) {
+				cg = ext2fs_sum_find(fs, size);
+				if (cg < 0)
+					break;
+				result = ext2fs_hashalloc_cg(ip, cg, 0, size,
+				    lenp, allocator, nowait, &busy);
+				if (result)
+					return result;
+			}
+			cg = icg;
+		}
+		/*
+		 * 3: quadratic rehash
+		 */
+		for (i = 1; i < fs->e2fs_ncg; i *= 2) {
+			cg += i;
+			if (cg >= fs->e2fs_ncg)
+				cg -= fs->e2fs_ncg;
+			result = ext2fs_hashalloc_cg(ip, cg, 0, size, lenp,
+			    allocator, nowait, &busy);
+			if (result)
+				return result;
+		}
+		/*
+		 * 4: brute force search
+		 * Note that we start at i == 2, since 0 was checked initially,
+		 * and 1 is always checked in the quadratic rehash.
+		 */
+		cg = (icg + 2) % fs->e2fs_ncg;
+		for (i = 2; i < fs->e2fs_ncg; i++) {
+			result = ext2fs_hashalloc_cg(ip, cg, 0, size, lenp,
+			    allocator, nowait, &busy);
+			if (result)
+				return result;
+			cg++;
+			if (cg == fs->e2fs_ncg)
+				cg = 0;
+		}
+		if (busy == 0)
+			break;
 	}
 	return 0;
 }
 
+/*
+ * Call the allocator for one group with the group locked.  Without
+ * waiting, a busy group is counted in *busyp and skipped.
+ */
+static long
+ext2fs_hashalloc_cg(struct inode *ip, int cg, long pref, int size, int *lenp,
+		daddr_t (*allocator)(struct inode *, int, daddr_t, int, int *),
+		bool nowait, int *busyp)
+{
+	struct m_ext2fs *fs = ip->i_e2fs;
+	long result;
+
+	if (!ext2fs_cg_enter(fs, cg, nowait)) {
+		(*busyp)++;
+		return 0;
+	}
+	result = (*allocator)(ip, cg, pref, size, lenp);
+	ext2fs_cg_exit(fs, cg);
+	return result;
+}
+
+/*
+ * Lock a group, waiting for it unless nowait is set.  Returns false if
+ * the group was busy and nowait set.  The lock may be held while
+ * sleeping for the group's bitmaps.
+ */
+static bool
+ext2fs_cg_enter(struct m_ext2fs *fs, int cg, bool nowait)
+{
+	struct ext2fs_cginfo *ci = &fs->e2fs_cginfo[cg];
+
+	mutex_enter(&ci->ci_lock);
+	while (ci->ci_busy) {
+		if (nowait) {
+			mutex_exit(&ci->ci_lock);
+			return false;
+		}
+		cv_wait(&ci->ci_cv, &ci->ci_lock);
+	}
+	ci->ci_busy = true;
+	mutex_exit(&ci->ci_lock);
+	return true;
+}
+
+static void
+ext2fs_cg_exit(struct m_ext2fs *fs, int cg)
+{
+	struct ext2fs_cginfo *ci = &fs->e2fs_cginfo[cg];
+
+	mutex_enter(&ci->ci_lock);
+	KASSERT(ci->ci_busy);
+	ci->ci_busy = false;
+	cv_signal(&ci->ci_cv);
+	mutex_exit(&ci->ci_lock);
+}
+
 /*
  * Determine whether a block can be allocated.
  *
- * Check to see if a block of the appropriate size is available,
- * and if it is, allocate it.
+ * Check to see if a run of up to len blocks is available, and if it
+ * is, allocate it and return its length in *lenp.
  */
 
 static daddr_t
-ext2fs_alloccg(struct inode *ip, int cg, daddr_t bpref, int size)
+ext2fs_alloccg(struct inode *ip, int cg, daddr_t bpref, int len, int *lenp)
 {
 	struct m_ext2fs *fs;
+	struct ext2fs_cginfo *ci;
 	char *bbp;
 	struct buf *bp;
 	/* XXX ondisk32 */
-	int error, bno, start, end, loc;
+	int error, bno;
+	int32_t n, i __diagused;
 
 	fs = ip->i_e2fs;
 	if (fs->e2fs_gd[cg].ext2bgd_nbfree == 0)
 		return 0;
-	error = bread(ip->i_devvp, EXT2_FSBTODB(fs,
-		fs2h32(fs->e2fs_gd[cg].ext2bgd_b_bitmap)),
-		(int)fs->e2fs_bsize, B_MODIFY, &bp);
+	error = ext2fs_bitmap_get(ip->i_devvp, fs, cg, EXT2FS_BBITMAP,
+	    &bbp, &bp);
 	if (error) {
 		return 0;
 	}
-	bbp = (char *)bp->b_data;
 
 	if (dtog(fs, bpref) != cg)
 		bpref = 0;
@@ -357,62 +690,50 @@ ext2fs_alloccg(struct inode *ip, int cg, daddr_t bpref, int size)
 		fs->e2fs_gd[cg].ext2bgd_flags &= h2fs16(~E2FS_BG_BLOCK_UNINIT);
 	}
 
-	if (bpref != 0) {
-		bpref = dtogd(fs, bpref);
-		/*
-		 * if the requested block is available, use it
-		 */
-		if (isclr(bbp, bpref)) {
-			bno = bpref;
-			goto gotit;
-		}
-	}
+	ci = &fs->e2fs_cginfo[cg];
+	ext2fs_buddy_enter(fs, ci);
+	if (ci->ci_buddy == NULL)
+		ext2fs_buddy_build(fs, ci, bbp);
+
 	/*
-	 * no blocks in the requested cylinder, so take next
-	 * available one in this cylinder group.
-	 * first try to get 8 contigous blocks, then fall back to a single
-	 * block.
+	 * regular files allocate from their reservation window.  Failing
+	 * that, if the requested block is available with the whole run
+	 * after it, use it; otherwise take the nearest run of len (and at
+	 * least 8) contiguous free blocks, falling back to shorter runs.
 	 */
-	if (bpref)
-		start = dtogd(fs, bpref) / NBBY;
-	else
-		start = 0;
-	end = howmany(fs->e2fs.e2fs_fpg, NBBY) - start;
-	for (loc = start; loc < end; loc++) {
-		if (bbp[loc] == 0) {
-			bno = loc * NBBY;
+	bpref = bpref != 0 ? dtogd(fs, bpref) : -1;
+	if (ext2fs_rsvmax > 0 && (ip->i_e2fs_mode & IFMT) == IFREG) {
+		bno = ext2fs_rsv_alloc(ip, cg, ci, bpref, len, &n);
+		if (bno >= 0)
 			goto gotit;
-		}
 	}
-	for (loc = 0; loc < start; loc++) {
-		if (bbp[loc] == 0) {
-			bno = loc * NBBY;
+	if (bpref >= 0 && isclr(bbp, bpref)) {
+		bno = bpref;
+		n = ext2fs_buddy_runlen(fs, ci, bno, len);
+		if (n == len)
 			goto gotit;
-		}
 	}
-
-	bno = ext2fs_mapsearch(fs, bbp, bpref);
-#if 0
-	/*
-	 * XXX jdolecek mapsearch actually never fails, it panics instead.
-	 * If re-enabling, make sure to brele() before returning.
-	 */
-	if (bno < 0)
-		return 0;
-#endif
+	bno = ext2fs_buddy_find(fs, ci, bpref, MAX(len, NBBY), &n);
+	if (bno < 0) {
+		printf("cg = %d, fs = %s\n", cg, fs->e2fs_fsmnt);
+		panic("ext2fs_alloccg: map corrupted");
+		/* NOTREACHED */
+	}
+	n = MIN(n, len);
 gotit:
 #ifdef DIAGNOSTIC
-	if (isset(bbp, (daddr_t)bno)) {
+	i = ext2fs_bitmap_runlen(bbp, bno, n, 0);
+	if (i != n) {
 		printf("ext2fs_alloccgblk: cg=%d bno=%d fs=%s\n",
-			cg, bno, fs->e2fs_fsmnt);
+			cg, bno + i, fs->e2fs_fsmnt);
 		panic("ext2fs_alloccg: dup alloc");
 	}
 #endif
-	setbit(bbp, (daddr_t)bno);
-	fs->e2fs.e2fs_fbcount--;
-	ext2fs_cg_update(fs, cg, &fs->e2fs_gd[cg], -1, 0, 0, 0);
-	fs->e2fs_fmod = 1;
-	bdwrite(bp);
+	ext2fs_bitmap_set(bbp, bno, n, 1);
+	ext2fs_buddy_set(fs, ci, bno, n, 0);
+	ext2fs_cg_update(fs, cg, &fs->e2fs_gd[cg], -n, 0, 0, 0);
+	ext2fs_bitmap_put(fs, cg, EXT2FS_BBITMAP, bp);
+	*lenp = n;
 	return cg * fs->e2fs.e2fs_fpg + fs->e2fs.e2fs_first_dblock + bno;
 }
 
@@ -424,30 +745,30 @@ gotit:
  *   1) allocate the requested inode.
  *   2) allocate the next available inode after the requested
  *	  inode in the specified cylinder group.
+ * Groups whose inode table is not zeroed yet are left alone.
  */
 static daddr_t
-ext2fs_nodealloccg(struct inode *ip, int cg, daddr_t ipref, int mode)
+ext2fs_nodealloccg(struct inode *ip, int cg, daddr_t ipref, int mode,
+    int *lenp)
 {
 	struct m_ext2fs *fs;
 	char *ibp;
 	struct buf *bp;
-	int error, start, len, loc, map, i;
+	int error;
+	int32_t i;
 
 	ipref--; /* to avoid a lot of (ipref -1) */
 	if (ipref == -1)
 		ipref = 0;
 	fs = ip->i_e2fs;
-	if (fs->e2fs_gd[cg].ext2bgd_nifree == 0)
+	if (fs->e2fs_gd[cg].ext2bgd_nifree == 0 ||
+	    !ext2fs_itable_ready(fs, cg))
 		return 0;
-	error = bread(ip->i_devvp, EXT2_FSBTODB(fs,
-		fs2h32(fs->e2fs_gd[cg].ext2bgd_i_bitmap)),
-		(int)fs->e2fs_bsize, B_MODIFY, &bp);
+	error = ext2fs_bitmap_get(ip->i_devvp, fs, cg, EXT2FS_IBITMAP,
+	    &ibp, &bp);
 	if (error) {
 		return 0;
 	}
-	ibp = (char *)bp->b_data;
-
-	KASSERT(!E2FS_HAS_GD_CSUM(fs) || (fs->e2fs_gd[cg].ext2bgd_flags & h2fs16(E2FS_BG_INODE_ZEROED)) != 0);
 
 	/* initialize inode bitmap now if uninit */
 	if (__predict_false(E2FS_HAS_GD_CSUM(fs) &&
@@ -457,42 +778,43 @@ ext2fs_nodealloccg(struct inode *ip, int cg, daddr_t ipref, int mode)
 		fs->e2fs_gd[cg].ext2bgd_flags &= h2fs16(~E2FS_BG_INODE_UNINIT);
 	}
 
-	if (ipref) {
-		ipref %= fs->e2fs.e2fs_ipg;
-		if (isclr(ibp, ipref))
-			goto gotit;
+	ipref %= fs->e2fs.e2fs_ipg;
+	i = ext2fs_bitmap_ffc(ibp, ipref, fs->e2fs.e2fs_ipg);
+	if (i < 0)
+		i = ext2fs_bitmap_ffc(ibp, 0, ipref);
+	if (i < 0) {
+		printf("cg = %d, ipref = %lld, fs = %s\n",
+			cg, (long long)ipref, fs->e2fs_fsmnt);
+		panic("ext2fs_nodealloccg: map corrupted");
+		/* NOTREACHED */
 	}
-	start = ipref / NBBY;
-	len = howmany(fs->e2fs.e2fs_ipg - ipref, NBBY);
-	loc = skpc(0xff, len, &ibp[start]);
-	if (loc == 0) {
-		len = start + 1;
-		start = 0;
-		loc = skpc(0xff, len, &ibp[0]);
-		if (loc == 0) {
-			printf("cg = %d, ipref = %lld, fs = %s\n",
-				cg, (long long)ipref, fs->e2fs_fsmnt);
-			panic("ext2fs_nodealloccg: map corrupted");
-			/* NOTREACHED */
-		}
-	}
-	i = start + len - loc;
-	map = ibp[i] ^ 0xff;
-	if (map == 0) {
-		printf("fs = %s\n", fs->e2fs_fsmnt);
-		panic("ext2fs_nodealloccg: inode not in map");
-	}
-	ipref = i * NBBY + ffs(map) - 1;
-gotit:
+	ipref = i;
 	setbit(ibp, ipref);
-	fs->e2fs.e2fs_ficount--;
 	ext2fs_cg_update(fs, cg, &fs->e2fs_gd[cg],
 		0, -1, ((mode & IFMT) == IFDIR) ? 1 : 0, ipref);
-	fs->e2fs_fmod = 1;
-	bdwrite(bp);
+	ext2fs_bitmap_put(fs, cg, EXT2FS_IBITMAP, bp);
 	return cg * fs->e2fs.e2fs_ipg + ipref + 1;
 }
 
+/*
+ * ext2fs_nodealloccg() for when the groups with a zeroed inode table
+ * are full: zero the group's table on the spot, ahead of the zeroing
+ * thread.
+ */
+static daddr_t
+ext2fs_nodealloccg_zero(struct inode *ip, int cg, daddr_t ipref, int mode,
+    int *lenp)
+{
+	struct m_ext2fs *fs = ip->i_e2fs;
+
+	if (fs->e2fs_gd[cg].ext2bgd_nifree == 0)
+		return 0;
+	if (!ext2fs_itable_ready(fs, cg) &&
+	    ext2fs_itable_zero(ip->i_devvp, fs, cg) != 0)
+		return 0;
+	return ext2fs_nodealloccg(ip, cg, ipref, mode, lenp);
+}
+
 /*
  * Free a block.
  *
@@ -502,41 +824,174 @@ gotit:
 void
 ext2fs_blkfree(struct inode *ip, daddr_t bno)
 {
-	struct m_ext2fs *fs;
-	char *bbp;
-	struct buf *bp;
-	int error, cg;
 
-	fs = ip->i_e2fs;
-	cg = dtog(fs, bno);
+	ext2fs_blkfree_range(ip, bno, 1);
+}
 
-	KASSERT(!E2FS_HAS_GD_CSUM(fs) || (fs->e2fs_gd[cg].ext2bgd_flags & h2fs16(E2FS_BG_BLOCK_UNINIT)) == 0);
+/*
+ * Free a run of contiguous blocks.
+ */
+void
+ext2fs_blkfree_range(struct inode *ip, daddr_t bno, daddr_t len)
+{
+	struct ext2fs_freelist fl;
+
+	ext2fs_freelist_init(&fl, ip);
+	ext2fs_freelist_add(&fl, bno, len);
+	ext2fs_freelist_flush(&fl);
+}
+
+/*
+ * Free lists batch the blocks released by a truncate.  Runs are
+ * coalesced as they are added, and a flush visits each group once:
+ * its bitmap is read and written back once and its descriptor
+ * checksum recomputed once, however many runs fall in it.
+ */
+void
+ext2fs_freelist_init(struct ext2fs_freelist *fl, struct inode *ip)
+{
 
-	if ((u_int)bno >= fs->e2fs.e2fs_bcount) {
+	fl->fl_ip = ip;
+	fl->fl_fs = ip->i_e2fs;
+	fl->fl_devvp = ip->i_devvp;
+	fl->fl_sync = false;
+	fl->fl_nrun = 0;
+}
+
+void
+ext2fs_freelist_add(struct ext2fs_freelist *fl, daddr_t bno, daddr_t len)
+{
+	struct inode *ip = fl->fl_ip;
+	struct m_ext2fs *fs = fl->fl_fs;
+	struct ext2fs_freerun *fr;
+
+	KASSERT(ip != NULL);
+	if (bno < 0 || len <= 0 || bno + len > fs->e2fs.e2fs_bcount) {
 		printf("bad block %lld, ino %llu\n", (long long)bno,
 		    (unsigned long long)ip->i_number);
 		ext2fs_fserr(fs, ip->i_uid, "bad block");
 		return;
 	}
-	error = bread(ip->i_devvp,
-		EXT2_FSBTODB(fs, fs2h32(fs->e2fs_gd[cg].ext2bgd_b_bitmap)),
-		(int)fs->e2fs_bsize, B_MODIFY, &bp);
-	if (error) {
+
+	/* truncation walks backwards, so try both ends of the last run */
+	if (fl->fl_nrun > 0) {
+		fr = &fl->fl_run[fl->fl_nrun - 1];
+		if (bno + len == fr->fr_bno) {
+			fr->fr_bno = bno;
+			fr->fr_len += len;
+			return;
+		}
+		if (fr->fr_bno + fr->fr_len == bno) {
+			fr->fr_len += len;
+			return;
+		}
+	}
+	if (ext2fs_freelist_full(fl)) {
+		KASSERT(!fl->fl_sync);
+		ext2fs_freelist_flush(fl);
+	}
+	fr = &fl->fl_run[fl->fl_nrun++];
+	fr->fr_bno = bno;
+	fr->fr_len = len;
+}
+
+/*
+ * Clear the runs starting at fl_run[i] that lie in group cg, under
+ * one hold of the group and its bitmap.  A run crossing into the
+ * next group is trimmed to the part left over.  Returns the index of
+ * the first run not finished.
+ */
+static int
+ext2fs_freelist_cg(struct ext2fs_freelist *fl, int cg, int i)
+{
+	struct m_ext2fs *fs = fl->fl_fs;
+	struct ext2fs_freerun *fr;
+	char *bbp;
+	struct buf *bp;
+	daddr_t loc, end;
+	int error, n, nfree;
+
+	KASSERT(!E2FS_HAS_GD_CSUM(fs) || (fs->e2fs_gd[cg].ext2bgd_flags & h2fs16(E2FS_BG_BLOCK_UNINIT)) == 0);
+
+	ext2fs_cg_enter(fs, cg, false);
+	error = ext2fs_bitmap_get(fl->fl_devvp, fs, cg, EXT2FS_BBITMAP,
+	    &bbp, &bp);
+	nfree = 0;
+	for (; i < fl->fl_nrun; i++) {
+		fr = &fl->fl_run[i];
+		if (dtog(fs, fr->fr_bno) != cg)
+			break;
+		loc = dtogd(fs, fr->fr_bno);
+		n = MIN(fr->fr_len, fs->e2fs.e2fs_bpg - loc);
+		if (error == 0) {
+			end = ext2fs_bitmap_runlen(bbp, loc, n, 1);
+			if (end != n) {
+				printf("dev = 0x%llx, block = %lld, fs = %s\n",
+				    (unsigned long long)fl->fl_devvp->v_rdev,
+				    (long long)(loc + end), fs->e2fs_fsmnt);
+				panic("blkfree: freeing free block");
+			}
+			ext2fs_bitmap_set(bbp, loc, n, 0);
+			if (fs->e2fs_cginfo[cg].ci_buddy != NULL)
+				ext2fs_buddy_set(fs, &fs->e2fs_cginfo[cg],
+				    loc, n, 1);
+			nfree += n;
+		}
+		fr->fr_bno += n;
+		fr->fr_len -= n;
+		if (fr->fr_len > 0)
+			break;
+	}
+	if (error == 0) {
+		ext2fs_cg_update(fs, cg, &fs->e2fs_gd[cg], nfree, 0, 0, 0);
+		ext2fs_bitmap_put(fs, cg, EXT2FS_BBITMAP, bp);
+	}
+	ext2fs_cg_exit(fs, cg);
+	return i;
+}
+
+/*
+ * Return the runs of a free list to the bitmaps, or with online
+ * discard hand them to the discard worker, which returns them once
+ * they are discarded.
+ */
+void
+ext2fs_freelist_flush(struct ext2fs_freelist *fl)
+{
+	struct m_ext2fs *fs = fl->fl_fs;
+	int i;
+
+	/* the inode must stop mapping the blocks on disk before they go */
+	if (fl->fl_sync && fl->fl_nrun > 0)
+		(void)ext2fs_update(ITOV(fl->fl_ip), NULL, NULL, UPDATE_WAIT);
+	if (fs->e2fs_dcq == NULL) {
+		ext2fs_freelist_release(fl);
 		return;
 	}
-	bbp = (char *)bp->b_data;
-	bno = dtogd(fs, bno);
-	if (isclr(bbp, bno)) {
-		printf("dev = 0x%llx, block = %lld, fs = %s\n",
-		    (unsigned long long)ip->i_dev, (long long)bno,
-		    fs->e2fs_fsmnt);
-		panic("blkfree: freeing free block");
+	for (i = 0; i < fl->fl_nrun; i++)
+		ext2fs_discard_queue(fs, fl->fl_run[i].fr_bno,
+		    fl->fl_run[i].fr_len);
+	fl->fl_nrun = 0;
+}
+
+static void
+ext2fs_freelist_release(struct ext2fs_freelist *fl)
+{
+	struct m_ext2fs *fs = fl->fl_fs;
+	struct ext2fs_freerun tmp;
+	int i, j;
+
+	/* sort by block so each group comes up once */
+	for (i = 1; i < fl->fl_nrun; i++) {
+		tmp = fl->fl_run[i];
+		for (j = i; j > 0 && fl->fl_run[j - 1].fr_bno > tmp.fr_bno;
+		    j--)
+			fl->fl_run[j] = fl->fl_run[j - 1];
+		fl->fl_run[j] = tmp;
 	}
-	clrbit(bbp, bno);
-	fs->e2fs.e2fs_fbcount++;
-	ext2fs_cg_update(fs, cg, &fs->e2fs_gd[cg], 1, 0, 0, 0);
-	fs->e2fs_fmod = 1;
-	bdwrite(bp);
+	for (i = 0; i < fl->fl_nrun; )
+		i = ext2fs_freelist_cg(fl, dtog(fs, fl->fl_run[i].fr_bno), i);
+	fl->fl_nrun = 0;
 }
 
 /*
@@ -565,13 +1020,13 @@ ext2fs_vfree(struct vnode *pvp, ino_t ino, int mode)
 
 	KASSERT(!E2FS_HAS_GD_CSUM(fs) || (fs->e2fs_gd[cg].ext2bgd_flags & h2fs16(E2FS_BG_INODE_UNINIT)) == 0);
 
-	error = bread(pip->i_devvp,
-		EXT2_FSBTODB(fs, fs2h32(fs->e2fs_gd[cg].ext2bgd_i_bitmap)),
-		(int)fs->e2fs_bsize, B_MODIFY, &bp);
+	ext2fs_cg_enter(fs, cg, false);
+	error = ext2fs_bitmap_get(pip->i_devvp, fs, cg, EXT2FS_IBITMAP,
+	    &ibp, &bp);
 	if (error) {
+		ext2fs_cg_exit(fs, cg);
 		return 0;
 	}
-	ibp = (char *)bp->b_data;
 	ino = (ino - 1) % fs->e2fs.e2fs_ipg;
 	if (isclr(ibp, ino)) {
 		printf("dev = 0x%llx, ino = %llu, fs = %s\n",
@@ -581,212 +1036,1497 @@ ext2fs_vfree(struct vnode *pvp, ino_t ino, int mode)
 			panic("ifree: freeing free inode");
 	}
 	clrbit(ibp, ino);
-	fs->e2fs.e2fs_ficount++;
 	ext2fs_cg_update(fs, cg, &fs->e2fs_gd[cg],
 		0, 1, ((mode & IFMT) == IFDIR) ? -1 : 0, 0);
-	fs->e2fs_fmod = 1;
-	bdwrite(bp);
+	ext2fs_bitmap_put(fs, cg, EXT2FS_IBITMAP, bp);
+	ext2fs_cg_exit(fs, cg);
 	return 0;
 }
 
 /*
- * Find a block in the specified cylinder group.
- *
- * It is a panic if a request is made to find a block if none are
- * available.
+ * Sum the flex group totals from the group descriptors.
  */
-
-static daddr_t
-ext2fs_mapsearch(struct m_ext2fs *fs, char *bbp, daddr_t bpref)
+static void
+ext2fs_flex_sum(struct m_ext2fs *fs)
 {
-	int start, len, loc, i, map;
+	struct ext2fs_flexinfo *fi;
+	struct ext2_gd *gd;
+	int cg;
 
-	/*
-	 * find the fragment by searching through the free block
-	 * map for an appropriate bit pattern
-	 */
-	if (bpref)
-		start = dtogd(fs, bpref) / NBBY;
-	else
-		start = 0;
-	len = howmany(fs->e2fs.e2fs_fpg, NBBY) - start;
-	loc = skpc(0xff, len, &bbp[start]);
-	if (loc == 0) {
-		len = start + 1;
-		start = 0;
-		loc = skpc(0xff, len, &bbp[start]);
-		if (loc == 0) {
-			printf("start = %d, len = %d, fs = %s\n",
-				start, len, fs->e2fs_fsmnt);
-			panic("ext2fs_alloccg: map corrupted");
-			/* NOTREACHED */
-		}
-	}
-	i = start + len - loc;
-	map = bbp[i] ^ 0xff;
-	if (map == 0) {
-		printf("fs = %s\n", fs->e2fs_fsmnt);
-		panic("ext2fs_mapsearch: block not in map");
+	memset(fs->e2fs_flexinfo, 0,
+	    fs->e2fs_nflex * sizeof(struct ext2fs_flexinfo));
+	for (cg = 0; cg < fs->e2fs_ncg; cg++) {
+		gd = &fs->e2fs_gd[cg];
+		fi = &fs->e2fs_flexinfo[cg_to_flex(fs, cg)];
+		fi->fi_nbfree += fs2h16(gd->ext2bgd_nbfree);
+		fi->fi_nifree += fs2h16(gd->ext2bgd_nifree);
+		fi->fi_ndirs += fs2h16(gd->ext2bgd_ndirs);
 	}
-	return i * NBBY + ffs(map) - 1;
 }
 
 /*
- * Fserr prints the name of a file system with an error diagnostic.
+ * Group summary.
  *
- * The form of the error message is:
- *	fs: error message
+ * Each group with free blocks is on the list for the order of its
+ * largest free chunk: exact once its buddy is built, and until then
+ * the order of its free block count, which is an upper bound.  After
+ * the preferred groups fail, ext2fs_hashalloc() takes groups from the
+ * lists instead of probing blindly, so a request goes straight to a
+ * group with a free run long enough for it.  A group taken is moved to
+ * the end of its list, spreading concurrent allocations over the
+ * groups of one list.
  */
-static void
-ext2fs_fserr(struct m_ext2fs *fs, u_int uid, const char *cp)
-{
 
-	log(LOG_ERR, "uid %d on %s: %s\n", uid, fs->e2fs_fsmnt, cp);
+static int32_t
+ext2fs_sum_order(struct m_ext2fs *fs, int cg)
+{
+	struct ext2fs_cginfo *ci = &fs->e2fs_cginfo[cg];
+	uint32_t nbfree;
+	int32_t k;
+
+	if (ci->ci_buddy != NULL) {
+		for (k = fs->e2fs_buddy_order; k >= 0; k--)
+			if (ci->ci_count[k] != 0)
+				return k;
+		return -1;
+	}
+	nbfree = fs2h16(fs->e2fs_gd[cg].ext2bgd_nbfree);
+	if (nbfree == 0)
+		return -1;
+	return MIN(fls32(nbfree) - 1, fs->e2fs_buddy_order);
 }
 
-static __inline void
-ext2fs_cg_update(struct m_ext2fs *fs, int cg, struct ext2_gd *gd, int nbfree, int nifree, int ndirs, daddr_t ioff)
+/*
+ * Move a group to the list its free space now calls for, with the
+ * group locked.
+ */
+static void
+ext2fs_sum_update(struct m_ext2fs *fs, int cg)
 {
-	/* XXX disk32 */
-	if (nifree) {
-		gd->ext2bgd_nifree = h2fs16(fs2h16(gd->ext2bgd_nifree) + nifree);
-		/*
-		 * If we allocated inode on bigger offset than what was
-		 * ever used before, bump the itable_unused count. This
-		 * member only ever grows, and is used only for initialization
-		 * !INODE_ZEROED groups with used inodes. Of course, by the
-		 * time we get here the itables are already zeroed, but
-		 * e2fstools fsck.ext4 still checks this.
-		 */
-		if (E2FS_HAS_GD_CSUM(fs) && nifree < 0 && (ioff+1) >= (fs->e2fs.e2fs_ipg - fs2h16(gd->ext2bgd_itable_unused_lo))) {
-			gd->ext2bgd_itable_unused_lo = h2fs16(fs->e2fs.e2fs_ipg - (ioff + 1));
-		}
-
-		KASSERT(!E2FS_HAS_GD_CSUM(fs) || gd->ext2bgd_itable_unused_lo <= gd->ext2bgd_nifree);
-	}
+	struct ext2fs_cginfo *ci = &fs->e2fs_cginfo[cg];
+	int32_t k;
 
+	k = ext2fs_sum_order(fs, cg);
+	if (k == ci->ci_sumorder)
+		return;
+	mutex_enter(&fs->e2fs_sumlock);
+	if (ci->ci_sumorder >= 0)
+		TAILQ_REMOVE(&fs->e2fs_sum[ci->ci_sumorder], ci, ci_sum);
+	if (k >= 0)
+		TAILQ_INSERT_TAIL(&fs->e2fs_sum[k], ci, ci_sum);
+	ci->ci_sumorder = k;
+	mutex_exit(&fs->e2fs_sumlock);
+}
 
-	if (nbfree)
-		gd->ext2bgd_nbfree = h2fs16(fs2h16(gd->ext2bgd_nbfree) + nbfree);
+/*
+ * Pick a group for a run of len blocks: one from the lowest order list
+ * whose chunks cover len, so larger chunks are kept for larger
+ * requests, or failing that one from the highest order list there is.
+ * Returns -1 if no group has free blocks.
+ */
+static int
+ext2fs_sum_find(struct m_ext2fs *fs, int len)
+{
+	struct ext2fs_cginfo *ci;
+	int32_t k, want;
+
+	want = MIN(len > 1 ? fls32(len - 1) : 0, fs->e2fs_buddy_order);
+	mutex_enter(&fs->e2fs_sumlock);
+	for (k = want; k <= fs->e2fs_buddy_order; k++)
+		if (!TAILQ_EMPTY(&fs->e2fs_sum[k]))
+			goto found;
+	for (k = want - 1; k >= 0; k--)
+		if (!TAILQ_EMPTY(&fs->e2fs_sum[k]))
+			goto found;
+	mutex_exit(&fs->e2fs_sumlock);
+	return -1;
+found:
+	ci = TAILQ_FIRST(&fs->e2fs_sum[k]);
+	TAILQ_REMOVE(&fs->e2fs_sum[k], ci, ci_sum);
+	TAILQ_INSERT_TAIL(&fs->e2fs_sum[k], ci, ci_sum);
+	mutex_exit(&fs->e2fs_sumlock);
+	return ci - fs->e2fs_cginfo;
+}
 
-	if (ndirs)
-		gd->ext2bgd_ndirs = h2fs16(fs2h16(gd->ext2bgd_ndirs) + ndirs);
+/*
+ * Bitmap cache.
+ *
+ * With ext2fs_bmcache set, the bitmaps of up to that many recently
+ * used groups are kept in memory, where memory pressure cannot take
+ * them, and are modified there rather than in the buffer cache.  They
+ * are written back when their group drops off the end of the LRU list
+ * to make room, and by ext2fs_bitmap_flush() when the file system is
+ * synced.  A cached bitmap is only touched with its group locked; the
+ * LRU list has a lock of its own.  Groups that cannot be cached are
+ * handled through the buffer cache as before.
+ */
+static daddr_t
+ext2fs_bitmap_blkno(struct m_ext2fs *fs, int cg, int which)
+{
+	struct ext2_gd *gd = &fs->e2fs_gd[cg];
 
-	if (E2FS_HAS_GD_CSUM(fs))
-		gd->ext2bgd_checksum = ext2fs_cg_get_csum(fs, cg, gd);
+	return EXT2_FSBTODB(fs, fs2h32(which == EXT2FS_BBITMAP ?
+	    gd->ext2bgd_b_bitmap : gd->ext2bgd_i_bitmap));
 }
 
 /*
- * Compute group description csum. Structure data must be LE (not host).
- * Returned as LE (disk encoding).
+ * Write back a group's cached bitmap, with the group locked: waiting
+ * for MNT_WAIT, as a delayed write for 0, asynchronously otherwise.
  */
-static uint16_t
-ext2fs_cg_get_csum(struct m_ext2fs *fs, int cg, struct ext2_gd *gd)
+static int
+ext2fs_bitmap_writeback(struct vnode *devvp, struct m_ext2fs *fs, int cg,
+    int which, int waitfor)
 {
-	uint16_t crc;
-	uint32_t cg_bswapped = h2fs32((uint32_t)cg);
-	size_t off;
+	struct ext2fs_cginfo *ci = &fs->e2fs_cginfo[cg];
+	struct buf *bp;
+	int error = 0;
 
-	if (!EXT2F_HAS_ROCOMPAT_FEATURE(fs, EXT2F_ROCOMPAT_GDT_CSUM))
+	if (!ci->ci_bmdirty[which])
 		return 0;
+	bp = getblk(devvp, ext2fs_bitmap_blkno(fs, cg, which),
+	    fs->e2fs_bsize, 0, 0);
+	memcpy(bp->b_data, ci->ci_bitmap[which], fs->e2fs_bsize);
+	ci->ci_bmdirty[which] = false;
+	if (waitfor == MNT_WAIT)
+		error = bwrite(bp);
+	else if (waitfor == 0)
+		bdwrite(bp);
+	else
+		bawrite(bp);
+	return error;
+}
 
-	off = offsetof(struct ext2_gd, ext2bgd_checksum);
-
-	crc = crc16(~0, (uint8_t *)fs->e2fs.e2fs_uuid, sizeof(fs->e2fs.e2fs_uuid));
-	crc = crc16(crc, (uint8_t *)&cg_bswapped, sizeof(cg_bswapped));
-	crc = crc16(crc, (uint8_t *)gd, off);
-	/* XXX ondisk32 */
-
-	return h2fs16(crc);
+/*
+ * Make room for, and enter, a group in the bitmap cache, with the group
+ * locked.  Returns false if there is no room: the cache is disabled or
+ * the groups that would be evicted are all busy.
+ */
+static bool
+ext2fs_bitmap_enter(struct vnode *devvp, struct m_ext2fs *fs, int cg)
+{
+	struct ext2fs_cginfo *ci = &fs->e2fs_cginfo[cg], *vci;
+	int vcg, w;
+
+	mutex_enter(&fs->e2fs_bmlock);
+	if (ci->ci_cached) {
+		TAILQ_REMOVE(&fs->e2fs_bmlru, ci, ci_lru);
+		TAILQ_INSERT_HEAD(&fs->e2fs_bmlru, ci, ci_lru);
+		mutex_exit(&fs->e2fs_bmlock);
+		return true;
+	}
+	while (fs->e2fs_bmcount >= ext2fs_bmcache) {
+		TAILQ_FOREACH_REVERSE(vci, &fs->e2fs_bmlru, ext2fs_cginfo_lru,
+		    ci_lru) {
+			if (ext2fs_cg_enter(fs, vci - fs->e2fs_cginfo, true))
+				break;
+		}
+		if (vci == NULL) {
+			mutex_exit(&fs->e2fs_bmlock);
+			return false;
+		}
+		TAILQ_REMOVE(&fs->e2fs_bmlru, vci, ci_lru);
+		vci->ci_cached = false;
+		fs->e2fs_bmcount--;
+		mutex_exit(&fs->e2fs_bmlock);
+
+		vcg = vci - fs->e2fs_cginfo;
+		for (w = EXT2FS_BBITMAP; w <= EXT2FS_IBITMAP; w++) {
+			if (vci->ci_bitmap[w] == NULL)
+				continue;
+			(void)ext2fs_bitmap_writeback(devvp, fs, vcg, w, 0);
+			kmem_free(vci->ci_bitmap[w], fs->e2fs_bsize);
+			vci->ci_bitmap[w] = NULL;
+		}
+		ext2fs_cg_exit(fs, vcg);
+		mutex_enter(&fs->e2fs_bmlock);
+	}
+	TAILQ_INSERT_HEAD(&fs->e2fs_bmlru, ci, ci_lru);
+	ci->ci_cached = true;
+	fs->e2fs_bmcount++;
+	mutex_exit(&fs->e2fs_bmlock);
+	return true;
 }
 
-static void
-ext2fs_init_bb(struct m_ext2fs *fs, int cg, struct ext2_gd *gd, char *bbp)
+/*
+ * Get a group's block or inode bitmap to modify, with the group locked.
+ * *datap is set to the bitmap, and *bpp to the buffer holding it, or
+ * NULL when the bitmap is cached.  Release with ext2fs_bitmap_put().
+ */
+static int
+ext2fs_bitmap_get(struct vnode *devvp, struct m_ext2fs *fs, int cg,
+    int which, char **datap, struct buf **bpp)
 {
-	int i;
+	struct ext2fs_cginfo *ci = &fs->e2fs_cginfo[cg];
+	struct buf *bp;
+	int error;
 
-	memset(bbp, 0, fs->e2fs_bsize);
+	*bpp = NULL;
+	if (ci->ci_bitmap[which] != NULL) {
+		(void)ext2fs_bitmap_enter(devvp, fs, cg);
+		*datap = ci->ci_bitmap[which];
+		return 0;
+	}
+	error = bread(devvp, ext2fs_bitmap_blkno(fs, cg, which),
+	    (int)fs->e2fs_bsize, B_MODIFY, &bp);
+	if (error)
+		return error;
+	if (ext2fs_bmcache > 0 && ext2fs_bitmap_enter(devvp, fs, cg)) {
+		ci->ci_bitmap[which] = kmem_alloc(fs->e2fs_bsize, KM_SLEEP);
+		memcpy(ci->ci_bitmap[which], bp->b_data, fs->e2fs_bsize);
+		brelse(bp, 0);
+		*datap = ci->ci_bitmap[which];
+		return 0;
+	}
+	*bpp = bp;
+	*datap = (char *)bp->b_data;
+	return 0;
+}
 
-	/*
-	 * No block was ever allocated on this cg before, so the only used
-	 * blocks are metadata blocks on start of the group. We could optimize
-	 * this to set by bytes, but since this is done once per the group
-	 * in lifetime of filesystem, it really is not worth it.
-	 */
-	for(i=0; i < fs->e2fs.e2fs_bpg - fs2h16(gd->ext2bgd_nbfree); i++)
-		setbit(bbp, i);
+/*
+ * Release a bitmap from ext2fs_bitmap_get() after modifying it.
+ */
+static void
+ext2fs_bitmap_put(struct m_ext2fs *fs, int cg, int which, struct buf *bp)
+{
+
+	if (bp == NULL)
+		fs->e2fs_cginfo[cg].ci_bmdirty[which] = true;
+	else
+		bdwrite(bp);
 }
 
 /*
- * Verify csum and initialize itable if not done already
+ * Write back all cached bitmaps that were modified.
  */
 int
-ext2fs_cg_verify_and_initialize(struct vnode *devvp, struct m_ext2fs *fs, int ronly)
+ext2fs_bitmap_flush(struct vnode *devvp, struct m_ext2fs *fs, int waitfor)
 {
-	/* XXX disk32 */
-	struct ext2_gd *gd;
-	ino_t ioff;
-	size_t boff;
-	struct buf *bp;
-	int cg, i, error;
+	struct ext2fs_cginfo *ci;
+	int cg, w, error, allerror = 0;
 
-	if (!E2FS_HAS_GD_CSUM(fs))
-		return 0;
+	for (cg = 0; cg < fs->e2fs_ncg; cg++) {
+		ci = &fs->e2fs_cginfo[cg];
+		if (!ci->ci_cached)
+			continue;
+		ext2fs_cg_enter(fs, cg, false);
+		for (w = EXT2FS_BBITMAP; w <= EXT2FS_IBITMAP; w++) {
+			if (ci->ci_bitmap[w] == NULL)
+				continue;
+			error = ext2fs_bitmap_writeback(devvp, fs, cg, w,
+			    waitfor);
+			if (error && !allerror)
+				allerror = error;
+		}
+		ext2fs_cg_exit(fs, cg);
+	}
+	return allerror;
+}
 
-	for(cg=0; cg < fs->e2fs_ncg; cg++) {
-		gd = &fs->e2fs_gd[cg];
+/*
+ * Free block and inode counts.
+ *
+ * Allocating and freeing only adjust the current CPU's count, which is
+ * folded into the superblock once it is EXT2FS_PCPU_BATCH off, so the
+ * superblock counts lag the real ones by less than that per CPU.  They
+ * are summed exactly where it matters: when the file system is close
+ * to full, for statvfs, and folded before the superblock is written.
+ */
+static void
+ext2fs_count_add(struct m_ext2fs *fs, int nbfree, int nifree)
+{
+	struct ext2fs_pcpu *pc;
+
+	pc = percpu_getref(fs->e2fs_pcpu);
+	pc->pc_nbfree += nbfree;
+	pc->pc_nifree += nifree;
+	if (pc->pc_nbfree >= EXT2FS_PCPU_BATCH ||
+	    pc->pc_nbfree <= -EXT2FS_PCPU_BATCH) {
+		atomic_add_32(&fs->e2fs.e2fs_fbcount, pc->pc_nbfree);
+		pc->pc_nbfree = 0;
+	}
+	if (pc->pc_nifree >= EXT2FS_PCPU_BATCH ||
+	    pc->pc_nifree <= -EXT2FS_PCPU_BATCH) {
+		atomic_add_32(&fs->e2fs.e2fs_ficount, pc->pc_nifree);
+		pc->pc_nifree = 0;
+	}
+	percpu_putref(fs->e2fs_pcpu);
+}
+
+static void
+ext2fs_count_sum(void *p, void *arg, struct cpu_info *ci)
+{
+	const struct ext2fs_pcpu *pc = p;
+	int64_t *sum = arg;
+
+	sum[0] += pc->pc_nbfree;
+	sum[1] += pc->pc_nifree;
+}
+
+/*
+ * Free blocks in the file system.  The superblock count is returned
+ * when it is clearly above low, the exact count otherwise.
+ */
+int64_t
+ext2fs_count_nbfree(struct m_ext2fs *fs, int64_t low)
+{
+	int64_t sum[2];
+
+	sum[0] = fs->e2fs.e2fs_fbcount;
+	if (sum[0] - (int64_t)ncpu * EXT2FS_PCPU_BATCH > low)
+		return sum[0];
+	sum[1] = 0;
+	percpu_foreach(fs->e2fs_pcpu, ext2fs_count_sum, sum);
+	return sum[0];
+}
+
+/*
+ * Free inodes in the file system, as ext2fs_count_nbfree().
+ */
+int64_t
+ext2fs_count_nifree(struct m_ext2fs *fs, int64_t low)
+{
+	int64_t sum[2];
+
+	sum[1] = fs->e2fs.e2fs_ficount;
+	if (sum[1] - (int64_t)ncpu * EXT2FS_PCPU_BATCH > low)
+		return sum[1];
+	sum[0] = 0;
+	percpu_foreach(fs->e2fs_pcpu, ext2fs_count_sum, sum);
+	return sum[1];
+}
+
+static void
+ext2fs_count_fold_xc(void *arg1, void *arg2)
+{
+	struct m_ext2fs *fs = arg1;
+	struct ext2fs_pcpu *pc;
+
+	pc = percpu_getref(fs->e2fs_pcpu);
+	atomic_add_32(&fs->e2fs.e2fs_fbcount, pc->pc_nbfree);
+	atomic_add_32(&fs->e2fs.e2fs_ficount, pc->pc_nifree);
+	pc->pc_nbfree = pc->pc_nifree = 0;
+	percpu_putref(fs->e2fs_pcpu);
+}
+
+/*
+ * Fold every CPU's counts into the superblock, on that CPU.
+ */
+void
+ext2fs_count_fold(struct m_ext2fs *fs)
+{
+
+	xc_wait(xc_broadcast(0, ext2fs_count_fold_xc, fs, NULL));
+}
+
+/* reservation windows, sorted by first block */
+static int
+ext2fs_rsv_compare_nodes(void *ctx, const void *n1, const void *n2)
+{
+	const struct ext2fs_rsv *r1 = n1, *r2 = n2;
+
+	if (r1->rsv_start < r2->rsv_start)
+		return -1;
+	if (r1->rsv_start > r2->rsv_start)
+		return 1;
+	return 0;
+}
+
+static int
+ext2fs_rsv_compare_key(void *ctx, const void *n, const void *key)
+{
+	const struct ext2fs_rsv *r = n;
+	const daddr_t bno = *(const daddr_t *)key;
+
+	if (r->rsv_start < bno)
+		return -1;
+	if (r->rsv_start > bno)
+		return 1;
+	return 0;
+}
+
+static const rb_tree_ops_t ext2fs_rsv_tree_ops = {
+	.rbto_compare_nodes = ext2fs_rsv_compare_nodes,
+	.rbto_compare_key = ext2fs_rsv_compare_key,
+	.rbto_node_offset = offsetof(struct ext2fs_rsv, rsv_node),
+	.rbto_context = NULL
+};
+
+/*
+ * Set up the in-memory group state.  Each order's free map of the
+ * buddy starts on a word boundary after the previous one; the maps
+ * themselves are only allocated once a group is allocated from.
+ * The flex group totals are summed from the group descriptors, and
+ * the reservation window tree starts out empty.
+ */
+void
+ext2fs_cginfo_init(struct m_ext2fs *fs)
+{
+	struct ext2fs_cginfo *ci;
+	int32_t k, off;
+	int cg;
+	daddr_t left;
+
+	fs->e2fs_buddy_order = MIN(ilog2(fs->e2fs.e2fs_fpg),
+	    EXT2FS_BUDDY_MAXORDER);
+	for (off = 0, k = 0; k <= fs->e2fs_buddy_order; k++) {
+		fs->e2fs_buddy_off[k] = off;
+		off += howmany(fs->e2fs.e2fs_fpg >> k, 64);
+	}
+	fs->e2fs_buddy_words = off;
+
+	fs->e2fs_cginfo = kmem_zalloc(fs->e2fs_ncg *
+	    sizeof(struct ext2fs_cginfo), KM_SLEEP);
+	left = fs->e2fs.e2fs_bcount - fs->e2fs.e2fs_first_dblock;
+	for (cg = 0; cg < fs->e2fs_ncg; cg++) {
+		ci = &fs->e2fs_cginfo[cg];
+		ci->ci_nblk = MIN(left, fs->e2fs.e2fs_fpg);
+		left -= ci->ci_nblk;
+		mutex_init(&ci->ci_lock, MUTEX_DEFAULT, IPL_NONE);
+		cv_init(&ci->ci_cv, "ext2cg");
+	}
+	mutex_init(&fs->e2fs_lock, MUTEX_DEFAULT, IPL_NONE);
+	fs->e2fs_pcpu = percpu_alloc(sizeof(struct ext2fs_pcpu));
+	mutex_init(&fs->e2fs_bmlock, MUTEX_DEFAULT, IPL_NONE);
+	TAILQ_INIT(&fs->e2fs_bmlru);
+	fs->e2fs_bmcount = 0;
+	TAILQ_INIT(&fs->e2fs_buddylru);
+	fs->e2fs_buddycount = 0;
+
+	mutex_init(&fs->e2fs_sumlock, MUTEX_DEFAULT, IPL_NONE);
+	for (k = 0; k <= EXT2FS_BUDDY_MAXORDER; k++)
+		TAILQ_INIT(&fs->e2fs_sum[k]);
+	for (cg = 0; cg < fs->e2fs_ncg; cg++) {
+		fs->e2fs_cginfo[cg].ci_sumorder = -1;
+		ext2fs_sum_update(fs, cg);
+	}
+
+	fs->e2fs_flexshift = 0;
+	if (EXT2F_HAS_INCOMPAT_FEATURE(fs, EXT2F_INCOMPAT_FLEX_BG))
+		fs->e2fs_flexshift = MIN(fs->e2fs.e4fs_log_gpf, 16);
+	fs->e2fs_nflex = howmany(fs->e2fs_ncg, 1 << fs->e2fs_flexshift);
+	fs->e2fs_flexinfo = kmem_alloc(fs->e2fs_nflex *
+	    sizeof(struct ext2fs_flexinfo), KM_SLEEP);
+	ext2fs_flex_sum(fs);
+
+	mutex_init(&fs->e2fs_rsvlock, MUTEX_DEFAULT, IPL_NONE);
+	rb_tree_init(&fs->e2fs_rsvtree, &ext2fs_rsv_tree_ops);
+}
+
+/*
+ * Drop every group's buddy and cached bitmaps, to be rebuilt from the
+ * bitmaps on disk on demand, and resum the flex group totals from the
+ * group descriptors.
+ */
+void
+ext2fs_cginfo_invalidate(struct m_ext2fs *fs)
+{
+	struct ext2fs_cginfo *ci;
+	int cg, w;
+
+	for (cg = 0; cg < fs->e2fs_ncg; cg++) {
+		ci = &fs->e2fs_cginfo[cg];
+		for (w = EXT2FS_BBITMAP; w <= EXT2FS_IBITMAP; w++) {
+			if (ci->ci_bitmap[w] == NULL)
+				continue;
+			kmem_free(ci->ci_bitmap[w], fs->e2fs_bsize);
+			ci->ci_bitmap[w] = NULL;
+			ci->ci_bmdirty[w] = false;
+		}
+		ci->ci_cached = false;
+		if (ci->ci_buddy == NULL)
+			continue;
+		kmem_free(ci->ci_buddy,
+		    fs->e2fs_buddy_words * sizeof(uint64_t));
+		ci->ci_buddy = NULL;
+	}
+	TAILQ_INIT(&fs->e2fs_bmlru);
+	fs->e2fs_bmcount = 0;
+	TAILQ_INIT(&fs->e2fs_buddylru);
+	fs->e2fs_buddycount = 0;
+	ext2fs_flex_sum(fs);
+	for (cg = 0; cg < fs->e2fs_ncg; cg++)
+		ext2fs_sum_update(fs, cg);
+}
+
+void
+ext2fs_cginfo_destroy(struct m_ext2fs *fs)
+{
+	struct ext2fs_cginfo *ci;
+	int cg;
+
+	ext2fs_cginfo_invalidate(fs);
+	for (cg = 0; cg < fs->e2fs_ncg; cg++) {
+		ci = &fs->e2fs_cginfo[cg];
+		KASSERT(!ci->ci_busy);
+		cv_destroy(&ci->ci_cv);
+		mutex_destroy(&ci->ci_lock);
+	}
+	kmem_free(fs->e2fs_cginfo, fs->e2fs_ncg * sizeof(struct ext2fs_cginfo));
+	fs->e2fs_cginfo = NULL;
+	kmem_free(fs->e2fs_flexinfo,
+	    fs->e2fs_nflex * sizeof(struct ext2fs_flexinfo));
+	fs->e2fs_flexinfo = NULL;
+	KASSERT(RB_TREE_MIN(&fs->e2fs_rsvtree) == NULL);
+	mutex_destroy(&fs->e2fs_rsvlock);
+	mutex_destroy(&fs->e2fs_lock);
+	percpu_free(fs->e2fs_pcpu, sizeof(struct ext2fs_pcpu));
+	fs->e2fs_pcpu = NULL;
+	mutex_destroy(&fs->e2fs_bmlock);
+	mutex_destroy(&fs->e2fs_sumlock);
+}
+
+#define	BUDDY_MAP(fs, ci, k)	(&(ci)->ci_buddy[(fs)->e2fs_buddy_off[k]])
+#define	BUDDY_ISSET(map, i)	(((map)[(i) >> 6] >> ((i) & 63)) & 1)
+#define	BUDDY_FLIP(map, i)	((map)[(i) >> 6] ^= (uint64_t)1 << ((i) & 63))
+
+/*
+ * Recompute the orders above 0 over the chunks covering group blocks
+ * start .. start + len - 1.  A chunk is free when both its halves are.
+ */
+static void
+ext2fs_buddy_merge(struct m_ext2fs *fs, struct ext2fs_cginfo *ci,
+    int32_t start, int32_t len)
+{
+	uint64_t *map, *child;
+	int32_t i, k, hi, n;
+	int isfree;
+
+	for (k = 1; k <= fs->e2fs_buddy_order; k++) {
+		child = BUDDY_MAP(fs, ci, k - 1);
+		map = BUDDY_MAP(fs, ci, k);
+		n = ci->ci_nblk >> k;
+		hi = MIN((start + len - 1) >> k, n - 1);
+		for (i = start >> k; i <= hi; i++) {
+			isfree = BUDDY_ISSET(child, 2 * i) &&
+			    BUDDY_ISSET(child, 2 * i + 1);
+			if (isfree == (int)BUDDY_ISSET(map, i))
+				continue;
+			BUDDY_FLIP(map, i);
+			ci->ci_count[k] += isfree ? 1 : -1;
+		}
+	}
+}
+
+/*
+ * Keep the buddies of at most ext2fs_buddymax groups, each about twice
+ * the size of the block bitmap.  Called with the group locked before
+ * its buddy is used: the group becomes the most recently used, and if
+ * it has no buddy yet room is made by dropping the buddies of the
+ * least recently used groups.  A group that lost its buddy goes back
+ * to the summary list of its free block count and rebuilds the buddy
+ * from its bitmap when next allocated from.  Busy groups are skipped,
+ * so the limit may be exceeded for a while.
+ */
+static void
+ext2fs_buddy_enter(struct m_ext2fs *fs, struct ext2fs_cginfo *ci)
+{
+	struct ext2fs_cginfo *vci;
+	int vcg;
+
+	mutex_enter(&fs->e2fs_bmlock);
+	if (ci->ci_buddy != NULL) {
+		TAILQ_REMOVE(&fs->e2fs_buddylru, ci, ci_blru);
+		TAILQ_INSERT_HEAD(&fs->e2fs_buddylru, ci, ci_blru);
+		mutex_exit(&fs->e2fs_bmlock);
+		return;
+	}
+	while (ext2fs_buddymax > 0 &&
+	    fs->e2fs_buddycount >= ext2fs_buddymax) {
+		TAILQ_FOREACH_REVERSE(vci, &fs->e2fs_buddylru,
+		    ext2fs_cginfo_lru, ci_blru) {
+			if (ext2fs_cg_enter(fs, vci - fs->e2fs_cginfo, true))
+				break;
+		}
+		if (vci == NULL)
+			break;
+		TAILQ_REMOVE(&fs->e2fs_buddylru, vci, ci_blru);
+		fs->e2fs_buddycount--;
+		mutex_exit(&fs->e2fs_bmlock);
+
+		vcg = vci - fs->e2fs_cginfo;
+		kmem_free(vci->ci_buddy,
+		    fs->e2fs_buddy_words * sizeof(uint64_t));
+		vci->ci_buddy = NULL;
+		ext2fs_sum_update(fs, vcg);
+		ext2fs_cg_exit(fs, vcg);
+		mutex_enter(&fs->e2fs_bmlock);
+	}
+	/* the caller builds the buddy before anyone can evict it */
+	TAILQ_INSERT_HEAD(&fs->e2fs_buddylru, ci, ci_blru);
+	fs->e2fs_buddycount++;
+	mutex_exit(&fs->e2fs_bmlock);
+}
+
+/*
+ * Build a group's buddy from its block bitmap.
+ */
+static void
+ext2fs_buddy_build(struct m_ext2fs *fs, struct ext2fs_cginfo *ci,
+    const char *bbp)
+{
+	const uint64_t *bm = (const uint64_t *)bbp;
+	uint64_t *map;
+	int32_t i;
+
+	ci->ci_buddy = kmem_zalloc(fs->e2fs_buddy_words * sizeof(uint64_t),
+	    KM_SLEEP);
+	memset(ci->ci_count, 0, sizeof(ci->ci_count));
+	map = BUDDY_MAP(fs, ci, 0);
+	/* the bitmap in host order and inverted, 64 blocks at a time */
+	for (i = 0; i < ci->ci_nblk; i += 64)
+		map[i >> 6] = ~le64toh(bm[i >> 6]);
+	if (ci->ci_nblk & 63)
+		map[ci->ci_nblk >> 6] &= ((uint64_t)1 << (ci->ci_nblk & 63)) - 1;
+	ci->ci_count[0] = ext2fs_bitmap_count(bbp, ci->ci_nblk);
+	ext2fs_buddy_merge(fs, ci, 0, ci->ci_nblk);
+}
 
-		/* Verify checksum */
-		if (gd->ext2bgd_checksum != ext2fs_cg_get_csum(fs, cg, gd)) {
-			printf("ext2fs_cg_verify_and_initialize: group %d invalid csum\n", cg);
-			return EINVAL;
+/*
+ * Record group blocks start .. start + len - 1 as free or in use.
+ */
+static void
+ext2fs_buddy_set(struct m_ext2fs *fs, struct ext2fs_cginfo *ci,
+    int32_t start, int32_t len, int isfree)
+{
+	uint64_t *map;
+	int32_t i;
+
+	KASSERT(start >= 0 && len > 0 && start + len <= ci->ci_nblk);
+	map = BUDDY_MAP(fs, ci, 0);
+	for (i = start; i < start + len; i++) {
+		KASSERT((int)BUDDY_ISSET(map, i) != isfree);
+		BUDDY_FLIP(map, i);
+	}
+	ci->ci_count[0] += isfree ? len : -len;
+	ext2fs_buddy_merge(fs, ci, start, len);
+}
+
+/*
+ * Find the first set bit of an order's map at or after from, wrapping
+ * around to the start of the group.  Bits past n are never set.
+ */
+static int32_t
+ext2fs_buddy_scan(const uint64_t *map, int32_t from, int32_t n)
+{
+	uint64_t w;
+	int32_t i;
+
+	if (from < 0 || from >= n)
+		from = 0;
+	for (i = from; i < n; i = (i | 63) + 1) {
+		w = map[i >> 6] >> (i & 63);
+		if (w != 0)
+			return i + ffs64(w) - 1;
+	}
+	for (i = 0; i < from; i = (i | 63) + 1) {
+		w = map[i >> 6] >> (i & 63);
+		if (w != 0)
+			return i + ffs64(w) - 1;
+	}
+	return -1;
+}
+
+/*
+ * Count the free blocks starting at group block start, up to max.
+ */
+static int32_t
+ext2fs_buddy_runlen(struct m_ext2fs *fs, struct ext2fs_cginfo *ci,
+    int32_t start, int32_t max)
+{
+	const uint64_t *map;
+	uint64_t w;
+	int32_t i, n;
+
+	map = BUDDY_MAP(fs, ci, 0);
+	max = MIN(max, ci->ci_nblk - start);
+	for (n = 0; n < max; ) {
+		i = start + n;
+		w = ~map[i >> 6] >> (i & 63);
+		if (w != 0) {
+			n += ffs64(w) - 1;
+			break;
 		}
+		n += 64 - (i & 63);
+	}
+	return MIN(n, max);
+}
 
-		/* if mounting read-write, zero itable if not already done */
-		if (ronly || (gd->ext2bgd_flags & h2fs16(E2FS_BG_INODE_ZEROED)) != 0)
+/*
+ * Find free space for a run of len blocks in a group, near goal (group
+ * relative, -1 for none).  The highest order up to the one covering
+ * len that has a free chunk is searched forward from goal, so a run
+ * of len is found whenever the group has an aligned one, and the best
+ * the group has to offer otherwise.  A free goal is kept unless that
+ * gives a longer run.  Returns the group relative start and sets
+ * *runp to the run length found, at most len; -1 if the group is full.
+ */
+static int32_t
+ext2fs_buddy_find(struct m_ext2fs *fs, struct ext2fs_cginfo *ci,
+    int32_t goal, int32_t len, int32_t *runp)
+{
+	int32_t k, i, glen;
+
+	KASSERT(len > 0);
+	glen = 0;
+	if (goal >= 0 && goal < ci->ci_nblk &&
+	    BUDDY_ISSET(BUDDY_MAP(fs, ci, 0), goal)) {
+		glen = ext2fs_buddy_runlen(fs, ci, goal, len);
+		if (glen == len) {
+			*runp = glen;
+			return goal;
+		}
+	}
+	k = MIN(len > 1 ? fls32(len - 1) : 0, fs->e2fs_buddy_order);
+	for (; k >= 0 && ((int32_t)1 << k) > glen; k--) {
+		if (ci->ci_count[k] == 0)
 			continue;
+		i = ext2fs_buddy_scan(BUDDY_MAP(fs, ci, k),
+		    goal >= 0 ? goal >> k : 0, ci->ci_nblk >> k);
+		if (i < 0)
+			break;
+		*runp = ext2fs_buddy_runlen(fs, ci, i << k, len);
+		return i << k;
+	}
+	if (glen > 0) {
+		*runp = glen;
+		return goal;
+	}
+	return -1;
+}
 
+/*
+ * Reservation windows.
+ *
+ * A regular file allocates from a window of free blocks set aside for
+ * it, so that files growing at the same time in one group each stay
+ * contiguous instead of taking turns at the next free block.  Windows
+ * are only a placement hint: they are kept in a per mount tree sorted
+ * by first block, and a new window is placed clear of the others, but
+ * the bitmap is not touched and other allocations may still take the
+ * blocks.  A window used up by a growing file is followed by one twice
+ * the size, up to ext2fs_rsvmax, so the window follows the rate the
+ * file grows at.  Windows go away on last close and when the inode is
+ * inactivated or reclaimed.
+ */
+/*
+ * Allocate up to len blocks for a regular file in group cg from its
+ * window, near goal (group relative, -1 for none), moving or growing
+ * the window as needed.  Called with the group's bitmap held busy and
+ * its buddy built.  Returns the group relative start and sets *runp,
+ * or -1 if no window could be placed in the group.
+ */
+static int32_t
+ext2fs_rsv_alloc(struct inode *ip, int cg, struct ext2fs_cginfo *ci,
+    int32_t goal, int32_t len, int32_t *runp)
+{
+	struct m_ext2fs *fs = ip->i_e2fs;
+	struct ext2fs_rsv *rsv = &ip->inode_ext.e2fs.i_ext_cache.ec_rsv;
+	struct ext2fs_rsv *other;
+	const uint64_t *map;
+	daddr_t base, key;
+	int32_t bno, start, end, size, n;
+	int try;
+
+	base = (daddr_t)cg * fs->e2fs.e2fs_fpg + fs->e2fs.e2fs_first_dblock;
+	map = BUDDY_MAP(fs, ci, 0);
+	mutex_enter(&fs->e2fs_rsvlock);
+	if (rsv->rsv_start != 0 && dtog(fs, rsv->rsv_start) == cg) {
+		start = rsv->rsv_start - base;
+		end = rsv->rsv_end - base;
+		if (goal < 0 || (goal >= start && goal < end)) {
+			for (bno = MAX(goal, start); bno < end; bno++) {
+				if (!BUDDY_ISSET(map, bno))
+					continue;
+				n = ext2fs_buddy_runlen(fs, ci, bno,
+				    MIN(len, end - bno));
+				mutex_exit(&fs->e2fs_rsvlock);
+				*runp = n;
+				return bno;
+			}
+			goal = end;
+		}
+		/* used up: the next window is larger */
+		if (goal == end) {
+			if (rsv->rsv_size < ext2fs_rsvmax / 2)
+				rsv->rsv_size *= 2;
+			else
+				rsv->rsv_size = ext2fs_rsvmax;
+		}
+	}
+	if (rsv->rsv_start != 0) {
+		rb_tree_remove_node(&fs->e2fs_rsvtree, rsv);
+		rsv->rsv_start = rsv->rsv_end = 0;
+	}
+
+	/* place a new window, moving past the windows of other files */
+	size = MIN(MAX(MAX(rsv->rsv_size, len), EXT2FS_RSV_MIN), ci->ci_nblk);
+	for (try = 0; try < 8 && goal < ci->ci_nblk; try++) {
+		bno = ext2fs_buddy_find(fs, ci, goal, size, &n);
+		if (bno < 0)
+			break;
 		/*
-		 * We are skipping already used inodes, zero rest of itable
-		 * blocks. First block to zero could be only partial wipe, all
-		 * others are wiped completely. This might take a while,
-		 * there could be many inode table blocks. We use
-		 * delayed writes, so this shouldn't block for very
-		 * long.
+		 * walk the windows that can overlap the run: the one at or
+		 * before its start, which may reach into it, and those
+		 * starting inside it.  Cut the run short at the first
+		 * overlap if at least len blocks remain, else move past it.
 		 */
-		ioff = fs->e2fs.e2fs_ipg - fs2h16(gd->ext2bgd_itable_unused_lo);
+		key = base + bno;
+		other = rb_tree_find_node_leq(&fs->e2fs_rsvtree, &key);
+		if (other == NULL)
+			other = RB_TREE_MIN(&fs->e2fs_rsvtree);
+		for (; other != NULL && other->rsv_start < base + bno + n;
+		    other = RB_TREE_NEXT(&fs->e2fs_rsvtree, other)) {
+			if (other->rsv_end <= base + bno)
+				continue;
+			if (other->rsv_start - base - bno >= len) {
+				n = other->rsv_start - base - bno;
+			} else {
+				goal = other->rsv_end - base;
+				n = 0;
+			}
+			break;
+		}
+		if (n == 0)
+			continue;
+		rsv->rsv_start = base + bno;
+		rsv->rsv_end = base + bno + n;
+		rb_tree_insert_node(&fs->e2fs_rsvtree, rsv);
+		mutex_exit(&fs->e2fs_rsvlock);
+		*runp = MIN(n, len);
+		return bno;
+	}
+	mutex_exit(&fs->e2fs_rsvlock);
+	return -1;
+}
+
+/*
+ * Give up an inode's reservation window.
+ */
+void
+ext2fs_rsv_release(struct inode *ip)
+{
+	struct m_ext2fs *fs = ip->i_e2fs;
+	struct ext2fs_rsv *rsv = &ip->inode_ext.e2fs.i_ext_cache.ec_rsv;
+
+	if (rsv->rsv_start != 0) {
+		mutex_enter(&fs->e2fs_rsvlock);
+		rb_tree_remove_node(&fs->e2fs_rsvtree, rsv);
+		rsv->rsv_start = rsv->rsv_end = 0;
+		mutex_exit(&fs->e2fs_rsvlock);
+	}
+	rsv->rsv_size = EXT2FS_RSV_MIN;
+}
+
+/*
+ * Online discard.
+ *
+ * With -o discard, blocks being freed go to the discard queue of the
+ * mount instead of the bitmaps, merged with the run queued last when
+ * they adjoin it.  A second after the first run is queued a worker
+ * writes out the dirty metadata of the device, so that whatever
+ * dropped the blocks is on disk, then discards each run and only then
+ * frees it.  The blocks thus cannot be allocated again while their
+ * discard is in flight.
+ */
+static void
+ext2fs_discard_timeout(void *arg)
+{
+	struct ext2fs_dcq *dq = arg;
+
+	mutex_enter(&dq->dq_lock);
+	if (dq->dq_state == EXT2FS_DC_WAIT) {
+		dq->dq_state = EXT2FS_DC_RUN;
+		workqueue_enqueue(dq->dq_wq, &dq->dq_work, NULL);
+	}
+	mutex_exit(&dq->dq_lock);
+}
+
+static void
+ext2fs_discard_work(struct work *wk, void *arg)
+{
+	struct ext2fs_dcq *dq = arg;
+	struct m_ext2fs *fs = dq->dq_fs;
+	struct ext2fs_dcruns runs;
+	struct ext2fs_dcrun *dr;
+	struct ext2fs_freelist fl;
+
+	fl.fl_ip = NULL;
+	fl.fl_fs = fs;
+	fl.fl_devvp = dq->dq_devvp;
+	fl.fl_sync = false;
+	fl.fl_nrun = 0;
+
+	mutex_enter(&dq->dq_lock);
+	while (!TAILQ_EMPTY(&dq->dq_runs)) {
+		TAILQ_INIT(&runs);
+		TAILQ_CONCAT(&runs, &dq->dq_runs, dr_list);
+		mutex_exit(&dq->dq_lock);
+
+		vn_lock(dq->dq_devvp, LK_EXCLUSIVE | LK_RETRY);
+		(void)VOP_FSYNC(dq->dq_devvp, FSCRED, FSYNC_WAIT, 0, 0);
+		VOP_UNLOCK(dq->dq_devvp);
+
+		while ((dr = TAILQ_FIRST(&runs)) != NULL) {
+			TAILQ_REMOVE(&runs, dr, dr_list);
+			(void)VOP_FDISCARD(dq->dq_devvp,
+			    (off_t)dr->dr_bno << fs->e2fs_bshift,
+			    (off_t)dr->dr_len << fs->e2fs_bshift);
+			if (fl.fl_nrun == EXT2FS_FREELIST_MAX)
+				ext2fs_freelist_release(&fl);
+			fl.fl_run[fl.fl_nrun].fr_bno = dr->dr_bno;
+			fl.fl_run[fl.fl_nrun].fr_len = dr->dr_len;
+			fl.fl_nrun++;
+			kmem_free(dr, sizeof(*dr));
+		}
+		ext2fs_freelist_release(&fl);
+		mutex_enter(&dq->dq_lock);
+	}
+	dq->dq_state = EXT2FS_DC_IDLE;
+	cv_broadcast(&dq->dq_cv);
+	mutex_exit(&dq->dq_lock);
+}
+
+/*
+ * Queue a run of freed blocks for discarding.
+ */
+static void
+ext2fs_discard_queue(struct m_ext2fs *fs, daddr_t bno, daddr_t len)
+{
+	struct ext2fs_dcq *dq = fs->e2fs_dcq;
+	struct ext2fs_dcrun *dr;
+	daddr_t max;
+
+	max = EXT2FS_DISCARD_MAX >> fs->e2fs_bshift;
+	mutex_enter(&dq->dq_lock);
+	dr = TAILQ_LAST(&dq->dq_runs, ext2fs_dcruns);
+	if (dr != NULL && dr->dr_len + len <= max) {
+		if (bno + len == dr->dr_bno) {
+			dr->dr_bno = bno;
+			dr->dr_len += len;
+			mutex_exit(&dq->dq_lock);
+			return;
+		}
+		if (dr->dr_bno + dr->dr_len == bno) {
+			dr->dr_len += len;
+			mutex_exit(&dq->dq_lock);
+			return;
+		}
+	}
+	mutex_exit(&dq->dq_lock);
+
+	dr = kmem_alloc(sizeof(*dr), KM_SLEEP);
+	dr->dr_bno = bno;
+	dr->dr_len = len;
+	mutex_enter(&dq->dq_lock);
+	TAILQ_INSERT_TAIL(&dq->dq_runs, dr, dr_list);
+	if (dq->dq_state == EXT2FS_DC_IDLE) {
+		dq->dq_state = EXT2FS_DC_WAIT;
+		callout_schedule(&dq->dq_callout, hz);
+	}
+	mutex_exit(&dq->dq_lock);
+}
+
+/*
+ * Start online discard on a read-write mount.
+ */
+int
+ext2fs_discard_init(struct m_ext2fs *fs, struct vnode *devvp)
+{
+	struct ext2fs_dcq *dq;
+	int error;
+
+	if (fs->e2fs_dcq != NULL)
+		return 0;
+	dq = kmem_zalloc(sizeof(*dq), KM_SLEEP);
+	error = workqueue_create(&dq->dq_wq, "ext2dc", ext2fs_discard_work,
+	    dq, PRI_NONE, IPL_NONE, 0);
+	if (error) {
+		kmem_free(dq, sizeof(*dq));
+		return error;
+	}
+	callout_init(&dq->dq_callout, 0);
+	callout_setfunc(&dq->dq_callout, ext2fs_discard_timeout, dq);
+	mutex_init(&dq->dq_lock, MUTEX_DEFAULT, IPL_NONE);
+	cv_init(&dq->dq_cv, "ext2dc");
+	TAILQ_INIT(&dq->dq_runs);
+	dq->dq_fs = fs;
+	dq->dq_devvp = devvp;
+	dq->dq_state = EXT2FS_DC_IDLE;
+	fs->e2fs_dcq = dq;
+	return 0;
+}
+
+/*
+ * Discard and free everything queued, then stop online discard.
+ * Nothing may free blocks meanwhile: called on unmount and on the
+ * switch to read-only, after the files were flushed.
+ */
+void
+ext2fs_discard_fini(struct m_ext2fs *fs)
+{
+	struct ext2fs_dcq *dq = fs->e2fs_dcq;
+
+	if (dq == NULL)
+		return;
+	callout_halt(&dq->dq_callout, NULL);
+	mutex_enter(&dq->dq_lock);
+	if (dq->dq_state == EXT2FS_DC_WAIT) {
+		dq->dq_state = EXT2FS_DC_RUN;
+		workqueue_enqueue(dq->dq_wq, &dq->dq_work, NULL);
+	}
+	while (dq->dq_state != EXT2FS_DC_IDLE)
+		cv_wait(&dq->dq_cv, &dq->dq_lock);
+	mutex_exit(&dq->dq_lock);
+
+	fs->e2fs_dcq = NULL;
+	workqueue_destroy(dq->dq_wq);
+	callout_destroy(&dq->dq_callout);
+	cv_destroy(&dq->dq_cv);
+	mutex_destroy(&dq->dq_lock);
+	kmem_free(dq, sizeof(*dq));
+}
+
+/*
+ * Discard the free runs of at least minlen bytes in a byte range of
+ * the file system, for EXT2FS_IOC_FITRIM.  Each group stays locked
+ * while its runs are discarded, so none of them is allocated under
+ * the discard.  Groups whose block bitmap was never initialized have
+ * not been written to since mkfs and are skipped.
+ */
+int
+ext2fs_trim(struct vnode *vp, struct ext2fs_fstrim_range *fr,
+    kauth_cred_t cred)
+{
+	struct inode *ip = VTOI(vp);
+	struct m_ext2fs *fs = ip->i_e2fs;
+	struct buf *bp;
+	char *bbp;
+	daddr_t start, end, base, trimmed;
+	int32_t loc, lend, len, minlen;
+	int cg, error;
+
+	error = kauth_authorize_system(cred, KAUTH_SYSTEM_MOUNT,
+	    KAUTH_REQ_SYSTEM_MOUNT_UPDATE, vp->v_mount, NULL, NULL);
+	if (error)
+		return error;
+	if (fs->e2fs_ronly)
+		return EROFS;
+	if (fr->start >> fs->e2fs_bshift >= fs->e2fs.e2fs_bcount)
+		return EINVAL;
+
+	start = fr->start >> fs->e2fs_bshift;
+	end = start + MIN(fr->len >> fs->e2fs_bshift,
+	    (uint64_t)(fs->e2fs.e2fs_bcount - start));
+	start = MAX(start, fs->e2fs.e2fs_first_dblock);
+	minlen = howmany(MIN(fr->minlen,
+	    (uint64_t)fs->e2fs.e2fs_bpg << fs->e2fs_bshift), fs->e2fs_bsize);
+	minlen = MAX(minlen, 1);
+
+	trimmed = 0;
+	for (cg = dtog(fs, start); start < end; cg++) {
+		base = (daddr_t)cg * fs->e2fs.e2fs_bpg +
+		    fs->e2fs.e2fs_first_dblock;
+		loc = start - base;
+		lend = MIN(end - base, fs->e2fs_cginfo[cg].ci_nblk);
+		start = base + fs->e2fs.e2fs_bpg;
+		if (fs->e2fs_gd[cg].ext2bgd_nbfree == 0 ||
+		    (E2FS_HAS_GD_CSUM(fs) && (fs->e2fs_gd[cg].ext2bgd_flags &
+		    h2fs16(E2FS_BG_BLOCK_UNINIT)) != 0))
+			continue;
+
+		ext2fs_cg_enter(fs, cg, false);
+		error = ext2fs_bitmap_get(ip->i_devvp, fs, cg, EXT2FS_BBITMAP,
+		    &bbp, &bp);
+		if (error) {
+			ext2fs_cg_exit(fs, cg);
+			break;
+		}
+		while (loc < lend) {
+			loc = ext2fs_bitmap_ffc(bbp, loc, lend);
+			if (loc < 0)
+				break;
+			len = ext2fs_bitmap_runlen(bbp, loc, lend - loc, 0);
+			if (len >= minlen) {
+				error = VOP_FDISCARD(ip->i_devvp,
+				    (off_t)(base + loc) << fs->e2fs_bshift,
+				    (off_t)len << fs->e2fs_bshift);
+				if (error)
+					break;
+				trimmed += len;
+			}
+			loc += len;
+		}
+		if (bp != NULL)
+			brelse(bp, 0);
+		ext2fs_cg_exit(fs, cg);
+		if (error)
+			break;
+	}
+	fr->len = (uint64_t)trimmed << fs->e2fs_bshift;
+	return error;
+}
+
+/*
+ * Lazy inode table initialization.
+ *
+ * Groups made by mke2fs -E lazy_itable_init lack E2FS_BG_INODE_ZEROED:
+ * the part of their inode table past the inodes ever used was never
+ * written.  Rather than zeroing all of it at mount, a thread per
+ * read-write mount zeroes one table block at a time, a group at a
+ * time, pausing ext2fs_itinit_delay ms after each group.  Inodes are
+ * only allocated from groups whose table is zeroed, unless nothing
+ * else is left, see ext2fs_nodealloccg_zero().
+ */
+
+/*
+ * Zero block i of a group's inode table, with the group locked.  The
+ * block holding the first unused inode is only cleared from there on.
+ */
+static int
+ext2fs_itable_zero_blk(struct vnode *devvp, struct m_ext2fs *fs, int cg,
+    int i, bool sync)
+{
+	struct ext2_gd *gd = &fs->e2fs_gd[cg];
+	struct buf *bp;
+	ino_t ioff;
+	size_t boff;
+	daddr_t bn;
+	int error;
+
+	ioff = fs->e2fs.e2fs_ipg - fs2h16(gd->ext2bgd_itable_unused_lo);
+	boff = 0;
+	if (i == ioff / fs->e2fs_ipb)
 		boff = (ioff % fs->e2fs_ipb) * EXT2_DINODE_SIZE(fs);
+	bn = EXT2_FSBTODB(fs, fs2h32(gd->ext2bgd_i_tables) + i);
+	if (boff) {
+		/* partial wipe, must read old data */
+		error = bread(devvp, bn, (int)fs->e2fs_bsize, B_MODIFY, &bp);
+		if (error)
+			return error;
+		memset((char *)bp->b_data + boff, 0, fs->e2fs_bsize - boff);
+	} else {
+		/* complete wipe, the block holds no inode in use */
+		bp = getblk(devvp, bn, (int)fs->e2fs_bsize, 0, 0);
+		clrbuf(bp);
+	}
+	if (sync)
+		return bwrite(bp);
+	bdwrite(bp);
+	return 0;
+}
 
-		for(i = ioff / fs->e2fs_ipb; i < fs->e2fs_itpg; i++) {
-			if (boff) {
-				/* partial wipe, must read old data */
-				error = bread(devvp,
-					EXT2_FSBTODB(fs, fs2h32(gd->ext2bgd_i_tables) + i),
-					(int)fs->e2fs_bsize, B_MODIFY, &bp);
-				if (error) {
-					printf("ext2fs_cg_verify_and_initialize: can't read itable block");
-					return error;
-				}
-				memset((char *)bp->b_data + boff, 0, fs->e2fs_bsize - boff);
-				boff = 0;
-			} else {
-				/*
-				 * Complete wipe, don't need to read data. This
-				 * assumes nothing else is changing the data.
-				 */
-				bp = getblk(devvp,
-					EXT2_FSBTODB(fs, fs2h32(gd->ext2bgd_i_tables) + i),
-					(int)fs->e2fs_bsize, 0, 0);
-				clrbuf(bp);
+/*
+ * Record a group's inode table as zeroed, with the group locked.
+ */
+static void
+ext2fs_itable_done(struct m_ext2fs *fs, int cg)
+{
+	struct ext2_gd *gd = &fs->e2fs_gd[cg];
+
+	gd->ext2bgd_flags |= h2fs16(E2FS_BG_INODE_ZEROED);
+	gd->ext2bgd_checksum = ext2fs_cg_get_csum(fs, cg, gd);
+	fs->e2fs_fmod = 1;
+}
+
+/* first inode table block of a group that may need zeroing */
+#define	ext2fs_itable_first(fs, cg) \
+	(((fs)->e2fs.e2fs_ipg - \
+	    fs2h16((fs)->e2fs_gd[(cg)].ext2bgd_itable_unused_lo)) / \
+	    (fs)->e2fs_ipb)
+
+/*
+ * Zero the rest of a group's inode table at once, with the group
+ * locked.  Delayed writes keep this short.
+ */
+static int
+ext2fs_itable_zero(struct vnode *devvp, struct m_ext2fs *fs, int cg)
+{
+	int i, error;
+
+	for (i = ext2fs_itable_first(fs, cg); i < fs->e2fs_itpg; i++) {
+		error = ext2fs_itable_zero_blk(devvp, fs, cg, i, false);
+		if (error)
+			return error;
+	}
+	ext2fs_itable_done(fs, cg);
+	return 0;
+}
+
+/*
+ * The zeroing thread.  The group is locked only around each block,
+ * written synchronously so that the table is on disk by the time the
+ * group is marked; whoever zeroes it meanwhile wins, and the thread
+ * moves on.
+ */
+static void
+ext2fs_itinit_thread(void *arg)
+{
+	struct ext2fs_itinit *it = arg;
+	struct m_ext2fs *fs = it->it_fs;
+	int cg, i, error;
+	bool stop;
+
+	for (cg = 0; cg < fs->e2fs_ncg; cg++) {
+		if (ext2fs_itable_ready(fs, cg))
+			continue;
+		for (i = -1;; i++) {
+			mutex_enter(&it->it_lock);
+			stop = it->it_stop;
+			mutex_exit(&it->it_lock);
+			if (stop)
+				goto out;
+
+			ext2fs_cg_enter(fs, cg, false);
+			if (ext2fs_itable_ready(fs, cg)) {
+				ext2fs_cg_exit(fs, cg);
+				break;
+			}
+			if (i < 0)
+				i = ext2fs_itable_first(fs, cg);
+			if (i >= fs->e2fs_itpg) {
+				ext2fs_itable_done(fs, cg);
+				ext2fs_cg_exit(fs, cg);
+				break;
 			}
-	
-			bdwrite(bp);
+			error = ext2fs_itable_zero_blk(it->it_devvp, fs, cg, i,
+			    true);
+			ext2fs_cg_exit(fs, cg);
+			if (error) {
+				printf("%s: can't zero inode table of group "
+				    "%d, error %d\n", fs->e2fs_fsmnt, cg, error);
+				break;
+			}
+		}
+
+		mutex_enter(&it->it_lock);
+		if (!it->it_stop && ext2fs_itinit_delay > 0)
+			cv_timedwait(&it->it_cv, &it->it_lock,
+			    MAX(mstohz(ext2fs_itinit_delay), 1));
+		mutex_exit(&it->it_lock);
+	}
+out:
+	kthread_exit(0);
+}
+
+/*
+ * Start the zeroing thread of a read-write mount, unless every inode
+ * table is zeroed already.
+ */
+int
+ext2fs_itinit_start(struct m_ext2fs *fs, struct vnode *devvp)
+{
+	struct ext2fs_itinit *it;
+	int cg, error;
+
+	if (fs->e2fs_itinit != NULL)
+		return 0;
+	for (cg = 0; cg < fs->e2fs_ncg; cg++)
+		if (!ext2fs_itable_ready(fs, cg))
+			break;
+	if (cg == fs->e2fs_ncg)
+		return 0;
+
+	it = kmem_zalloc(sizeof(*it), KM_SLEEP);
+	mutex_init(&it->it_lock, MUTEX_DEFAULT, IPL_NONE);
+	cv_init(&it->it_cv, "ext2itin");
+	it->it_fs = fs;
+	it->it_devvp = devvp;
+	error = kthread_create(PRI_NONE, KTHREAD_MUSTJOIN, NULL,
+	    ext2fs_itinit_thread, it, &it->it_lwp, "ext2itinit");
+	if (error) {
+		cv_destroy(&it->it_cv);
+		mutex_destroy(&it->it_lock);
+		kmem_free(it, sizeof(*it));
+		return error;
+	}
+	fs->e2fs_itinit = it;
+	return 0;
+}
+
+/*
+ * Stop the zeroing thread, on unmount and on the switch to read-only.
+ * What it did not get to is left for the next read-write mount.
+ */
+void
+ext2fs_itinit_stop(struct m_ext2fs *fs)
+{
+	struct ext2fs_itinit *it = fs->e2fs_itinit;
+
+	if (it == NULL)
+		return;
+	mutex_enter(&it->it_lock);
+	it->it_stop = true;
+	cv_broadcast(&it->it_cv);
+	mutex_exit(&it->it_lock);
+	kthread_join(it->it_lwp);
+
+	fs->e2fs_itinit = NULL;
+	cv_destroy(&it->it_cv);
+	mutex_destroy(&it->it_lock);
+	kmem_free(it, sizeof(*it));
+}
+
+/*
+ * Fserr prints the name of a file system with an error diagnostic.
+ *
+ * The form of the error message is:
+ *	fs: error message
+ */
+static void
+ext2fs_fserr(struct m_ext2fs *fs, u_int uid, const char *cp)
+{
+
+	log(LOG_ERR, "uid %d on %s: %s\n", uid, fs->e2fs_fsmnt, cp);
+}
+
+static __inline void
+ext2fs_cg_update(struct m_ext2fs *fs, int cg, struct ext2_gd *gd, int nbfree, int nifree, int ndirs, daddr_t ioff)
+{
+	struct ext2fs_flexinfo *fi;
+
+	/* XXX disk32 */
+	if (nifree) {
+		gd->ext2bgd_nifree = h2fs16(fs2h16(gd->ext2bgd_nifree) + nifree);
+		/*
+		 * If we allocated inode on bigger offset than what was
+		 * ever used before, bump the itable_unused count. This
+		 * member only ever grows, and is used only for initialization
+		 * !INODE_ZEROED groups with used inodes. Of course, by the
+		 * time we get here the itables are already zeroed, but
+		 * e2fstools fsck.ext4 still checks this.
+		 */
+		if (E2FS_HAS_GD_CSUM(fs) && nifree < 0 && (ioff+1) >= (fs->e2fs.e2fs_ipg - fs2h16(gd->ext2bgd_itable_unused_lo))) {
+			gd->ext2bgd_itable_unused_lo = h2fs16(fs->e2fs.e2fs_ipg - (ioff + 1));
 		}
 
-		gd->ext2bgd_flags |= h2fs16(E2FS_BG_INODE_ZEROED);
+		KASSERT(!E2FS_HAS_GD_CSUM(fs) || gd->ext2bgd_itable_unused_lo <= gd->ext2bgd_nifree);
+	}
+
+
+	if (nbfree)
+		gd->ext2bgd_nbfree = h2fs16(fs2h16(gd->ext2bgd_nbfree) + nbfree);
+
+	if (ndirs)
+		gd->ext2bgd_ndirs = h2fs16(fs2h16(gd->ext2bgd_ndirs) + ndirs);
+
+	ext2fs_count_add(fs, nbfree, nifree);
+	fi = &fs->e2fs_flexinfo[cg_to_flex(fs, cg)];
+	if (nbfree)
+		atomic_add_32(&fi->fi_nbfree, nbfree);
+	if (nifree)
+		atomic_add_32(&fi->fi_nifree, nifree);
+	if (ndirs)
+		atomic_add_32(&fi->fi_ndirs, ndirs);
+	if (nbfree)
+		ext2fs_sum_update(fs, cg);
+	fs->e2fs_fmod = 1;
+
+	if (E2FS_HAS_GD_CSUM(fs))
 		gd->ext2bgd_checksum = ext2fs_cg_get_csum(fs, cg, gd);
-		fs->e2fs_fmod = 1;
+}
+
+/*
+ * Compute group description csum. Structure data must be LE (not host).
+ * Returned as LE (disk encoding).
+ */
+static uint16_t
+ext2fs_cg_get_csum(struct m_ext2fs *fs, int cg, struct ext2_gd *gd)
+{
+	uint16_t crc;
+	uint32_t cg_bswapped = h2fs32((uint32_t)cg);
+	size_t off;
+
+	if (!EXT2F_HAS_ROCOMPAT_FEATURE(fs, EXT2F_ROCOMPAT_GDT_CSUM))
+		return 0;
+
+	off = offsetof(struct ext2_gd, ext2bgd_checksum);
+
+	crc = crc16(~0, (uint8_t *)fs->e2fs.e2fs_uuid, sizeof(fs->e2fs.e2fs_uuid));
+	crc = crc16(crc, (uint8_t *)&cg_bswapped, sizeof(cg_bswapped));
+	crc = crc16(crc, (uint8_t *)gd, off);
+	/* XXX ondisk32 */
+
+	return h2fs16(crc);
+}
+
+static void
+ext2fs_init_bb(struct m_ext2fs *fs, int cg, struct ext2_gd *gd, char *bbp)
+{
+
+	memset(bbp, 0, fs->e2fs_bsize);
+
+	/*
+	 * No block was ever allocated on this cg before, so the only used
+	 * blocks are metadata blocks on start of the group.
+	 */
+	ext2fs_bitmap_set(bbp, 0,
+	    fs->e2fs.e2fs_bpg - fs2h16(gd->ext2bgd_nbfree), 1);
+}
+
+/*
+ * Verify the group descriptor checksums.  Inode tables not zeroed yet
+ * are left to ext2fs_itinit_start().
+ *
+ * With many groups every CPU joins in, each taking the next
+ * EXT2FS_VERIFY_CHUNK groups until none are left.
+ */
+#define	EXT2FS_VERIFY_CHUNK	1024
+
+struct ext2fs_verify {
+	struct m_ext2fs *v_fs;
+	volatile u_int	v_next;		/* next chunk to verify */
+	volatile u_int	v_bad;		/* a group with a bad csum, or -1 */
+};
+
+static void
+ext2fs_cg_verify_chunks(struct ext2fs_verify *v)
+{
+	struct m_ext2fs *fs = v->v_fs;
+	struct ext2_gd *gd;
+	u_int cg, last;
+
+	for (;;) {
+		cg = (atomic_inc_uint_nv(&v->v_next) - 1) *
+		    EXT2FS_VERIFY_CHUNK;
+		if (cg >= (u_int)fs->e2fs_ncg || v->v_bad != -1U)
+			return;
+		last = MIN(cg + EXT2FS_VERIFY_CHUNK, (u_int)fs->e2fs_ncg);
+		for (; cg < last; cg++) {
+			gd = &fs->e2fs_gd[cg];
+			if (gd->ext2bgd_checksum !=
+			    ext2fs_cg_get_csum(fs, cg, gd)) {
+				atomic_cas_uint(&v->v_bad, -1U, cg);
+				return;
+			}
+		}
 	}
+}
 
+static void
+ext2fs_cg_verify_xc(void *arg1, void *arg2)
+{
+
+	ext2fs_cg_verify_chunks(arg1);
+}
+
+int
+ext2fs_cg_verify(struct m_ext2fs *fs)
+{
+	struct ext2fs_verify v;
+
+	if (!E2FS_HAS_GD_CSUM(fs))
+		return 0;
+
+	v.v_fs = fs;
+	v.v_next = 0;
+	v.v_bad = -1U;
+	if (ncpu > 1 && fs->e2fs_ncg > EXT2FS_VERIFY_CHUNK)
+		xc_wait(xc_broadcast(0, ext2fs_cg_verify_xc, &v, NULL));
+	else
+		ext2fs_cg_verify_chunks(&v);
+	if (v.v_bad != -1U) {
+		printf("ext2fs_cg_verify: group %u invalid csum\n", v.v_bad);
+		return EINVAL;
+	}
 	return 0;
 }
@@ -77,12 +77,20 @@ __KERNEL_RCSID(0, "$NetBSD: ext2fs_balloc.c,v 1.41 2016/08/13 07:40:10 christos
 
 #include <uvm/uvm.h>
 
+#include <miscfs/genfs/genfs.h>
+#include <miscfs/genfs/genfs_node.h>
+
 #include <ufs/ufs/inode.h>
 #include <ufs/ufs/ufs_extern.h>
 
 #include <ufs/ext2fs/ext2fs.h>
+#include <ufs/ext2fs/ext2fs_extents.h>
 #include <ufs/ext2fs/ext2fs_extern.h>
 
+int ext2fs_delalloc = 0;
+
+static int	ext2fs_delalloc_scan(struct vnode *, daddr_t, daddr_t, bool);
+
 /*
  * Balloc defines the structure of file system storage
  * by allocating the physical blocks on a device given
@@ -113,6 +121,8 @@ ext2fs_balloc(struct inode *ip, daddr_t bn, int size,
 	}
 	if (bn < 0)
 		return EFBIG;
+	if (ip->i_e2fs_flags & EXT2_EXTENTS)
+		return ext4_ext_balloc(ip, bn, size, cred, bpp, flags);
 	fs = ip->i_e2fs;
 	lbn = bn;
 
@@ -352,6 +362,7 @@ ext2fs_gop_alloc(struct vnode *vp, off_t off, off_t len, int flags,
 {
 	struct inode *ip = VTOI(vp);
 	struct m_ext2fs *fs = ip->i_e2fs;
+	daddr_t lbn, count;
 	int error, delta, bshift, bsize;
 	UVMHIST_FUNC("ext2fs_gop_alloc"); UVMHIST_CALLED(ubchist);
 
@@ -362,6 +373,27 @@ ext2fs_gop_alloc(struct vnode *vp, off_t off, off_t len, int flags,
 	off -= delta;
 	len += delta;
 
+	/*
+	 * files mapped by extents get whole runs of blocks at a time,
+	 * their allocation does not depend on EOF.
+	 */
+	if (ip->i_e2fs_flags & EXT2_EXTENTS) {
+		lbn = ext2_lblkno(fs, off);
+		count = ext2_lblkno(fs, off + len - 1) - lbn + 1;
+		/* pages written under delayed allocation keep their data */
+		error = 0;
+		if (ip->inode_ext.e2fs.i_ext_cache.ec_ndelalloc != 0)
+			error = ext2fs_delalloc_scan(vp, lbn, count, true);
+		if (error == 0)
+			error = ext4_ext_alloc_range(ip, lbn, count, false,
+			    cred, flags);
+		if (error == 0 && ext2fs_size(ip) < off + len)
+			error = ext2fs_setsize(ip, off + len);
+		if (error)
+			UVMHIST_LOG(ubchist, "error %d", error, 0, 0, 0);
+		return error;
+	}
+
 	while (len > 0) {
 		bsize = min(bsize, len);
 		UVMHIST_LOG(ubchist, "off 0x%x len 0x%x bsize 0x%x",
@@ -399,3 +431,295 @@ ext2fs_gop_alloc(struct vnode *vp, off_t off, off_t len, int flags,
 	}
 	return 0;
 }
+
+/*
+ * Delayed allocation.
+ *
+ * On extent mapped files whose blocks are one page each, ext2fs_write()
+ * does not allocate holes it writes into.  It reserves free space for
+ * them and makes their pages writable and dirty; the blocks are only
+ * allocated when the pages are written back, a run of neighbouring
+ * pages at a time, so files written in small pieces still end up
+ * contiguous and files removed before writeback never reach the
+ * bitmaps.  A page of such a file that is resident and writable over a
+ * hole is a delayed allocation page and holds one reserved block.
+ *
+ * The genfs node lock, which serializes ext2fs_gop_alloc() with
+ * getpages, also covers allocating these blocks.
+ */
+
+void
+ext2fs_delalloc_unreserve(struct inode *ip, daddr_t n)
+{
+	struct ext4_extent_cache *ecp = &ip->inode_ext.e2fs.i_ext_cache;
+
+	n = MIN(n, ecp->ec_ndelalloc);
+	ecp->ec_ndelalloc -= n;
+	mutex_enter(&ip->i_e2fs->e2fs_lock);
+	ip->i_e2fs->e2fs_dablocks -= n;
+	mutex_exit(&ip->i_e2fs->e2fs_lock);
+}
+
+static int
+ext2fs_delalloc_reserve(struct inode *ip, daddr_t n, kauth_cred_t cred)
+{
+	struct m_ext2fs *fs = ip->i_e2fs;
+	daddr_t avail, rsvd;
+
+	rsvd = 0;
+	if (kauth_authorize_system(cred, KAUTH_SYSTEM_FS_RESERVEDSPACE, 0, NULL,
+	    NULL, NULL) != 0)
+		rsvd = fs->e2fs.e2fs_rbcount;
+	avail = ext2fs_count_nbfree(fs, rsvd + fs->e2fs_dablocks + n);
+	mutex_enter(&fs->e2fs_lock);
+	avail -= fs->e2fs_dablocks + rsvd;
+	if (avail < n) {
+		mutex_exit(&fs->e2fs_lock);
+		return ENOSPC;
+	}
+	fs->e2fs_dablocks += n;
+	mutex_exit(&fs->e2fs_lock);
+	ip->inode_ext.e2fs.i_ext_cache.ec_ndelalloc += n;
+	return 0;
+}
+
+/*
+ * Find the first run of delayed allocation pages within the hole
+ * [lbn, lbn + count).  Returns its first block and sets *lenp, or
+ * returns -1.
+ */
+static daddr_t
+ext2fs_delalloc_find(struct vnode *vp, daddr_t lbn, daddr_t count,
+    daddr_t *lenp)
+{
+	struct uvm_object *uobj = &vp->v_uobj;
+	struct vm_page *pg;
+	int bshift = VTOI(vp)->i_e2fs->e2fs_bshift;
+	voff_t off, end, start;
+
+	start = -1;
+	end = (voff_t)(lbn + count) << bshift;
+	mutex_enter(uobj->vmobjlock);
+	for (off = (voff_t)lbn << bshift; off < end; off = pg->offset + PAGE_SIZE) {
+		pg = rb_tree_find_node_geq(&uobj->rb_tree, &off);
+		if (pg == NULL || pg->offset >= end)
+			break;
+		if (start < 0) {
+			if ((pg->flags & PG_RDONLY) == 0)
+				start = pg->offset;
+			continue;
+		}
+		if (pg->offset != off || (pg->flags & PG_RDONLY) != 0)
+			break;
+	}
+	mutex_exit(uobj->vmobjlock);
+	if (start < 0)
+		return -1;
+	*lenp = (MIN(off, end) - start) >> bshift;
+	return start >> bshift;
+}
+
+/*
+ * Allocate the blocks of the delayed allocation pages in
+ * [lbn, lbn + count), one call per run of them, or with alloc false
+ * only give their reservations back.
+ */
+static int
+ext2fs_delalloc_scan(struct vnode *vp, daddr_t lbn, daddr_t count,
+    bool alloc)
+{
+	struct inode *ip = VTOI(vp);
+	struct m_ext2fs *fs = ip->i_e2fs;
+	struct ext2fs_map_run runs[16];
+	daddr_t start, len, next, end;
+	int i, nruns, error;
+
+	while (count > 0 && ip->inode_ext.e2fs.i_ext_cache.ec_ndelalloc > 0) {
+		error = ext2fs_bmap_range(ip, lbn, count, runs,
+		    __arraycount(runs), &nruns);
+		if (error)
+			return error;
+		if (nruns == 0)
+			break;
+		for (i = 0; i < nruns; i++) {
+			if ((runs[i].mr_flags & EXT2FS_MAP_HOLE) == 0)
+				continue;
+			next = runs[i].mr_lbn;
+			end = next + runs[i].mr_len;
+			while (next < end &&
+			    (start = ext2fs_delalloc_find(vp, next, end - next,
+			    &len)) >= 0) {
+				ext2fs_delalloc_unreserve(ip, len);
+				if (alloc) {
+					error = ext4_ext_alloc_range(ip, start,
+					    len, false, FSCRED, 0);
+					if (error) {
+						/* the pages still need them */
+						ip->inode_ext.e2fs.i_ext_cache.
+						    ec_ndelalloc += len;
+						mutex_enter(&fs->e2fs_lock);
+						fs->e2fs_dablocks += len;
+						mutex_exit(&fs->e2fs_lock);
+						return error;
+					}
+				}
+				next = start + len;
+			}
+		}
+		next = runs[nruns - 1].mr_lbn + runs[nruns - 1].mr_len;
+		count -= next - lbn;
+		lbn = next;
+	}
+	return 0;
+}
+
+/*
+ * ufs_balloc_range() for ext2fs_write() under delayed allocation.  A
+ * hole at off gets a reservation and its page is made writable and
+ * dirty; anything else is allocated right away.
+ */
+int
+ext2fs_delalloc_range(struct vnode *vp, off_t off, off_t len,
+    kauth_cred_t cred)
+{
+	struct inode *ip = VTOI(vp);
+	struct m_ext2fs *fs = ip->i_e2fs;
+	struct uvm_object *uobj = &vp->v_uobj;
+	struct ext2fs_map_run run;
+	struct vm_page *pg;
+	int npages, nruns, error;
+
+	KASSERT(fs->e2fs_bsize == PAGE_SIZE);
+	KASSERT(ext2_blkoff(fs, off) + len <= fs->e2fs_bsize);
+
+	genfs_node_wrlock(vp);
+	error = ext2fs_bmap_range(ip, ext2_lblkno(fs, off), 1, &run, 1, &nruns);
+	if (error || nruns == 0 || (run.mr_flags & EXT2FS_MAP_HOLE) == 0) {
+		genfs_node_unlock(vp);
+		if (error)
+			return error;
+		return ufs_balloc_range(vp, off, len, cred, 0);
+	}
+
+	pg = NULL;
+	npages = 1;
+	mutex_enter(uobj->vmobjlock);
+	error = VOP_GETPAGES(vp, trunc_page(off), &pg, &npages, 0,
+	    VM_PROT_WRITE, 0, PGO_SYNCIO | PGO_PASTEOF | PGO_NOBLOCKALLOC |
+	    PGO_NOTIMESTAMP | PGO_GLOCKHELD);
+	if (error) {
+		genfs_node_unlock(vp);
+		return error;
+	}
+
+	if (ext2fs_size(ip) < off + len)
+		error = ext2fs_setsize(ip, off + len);
+	/* a writable page over a hole holds its reservation already */
+	if (error == 0 && (pg->flags & PG_RDONLY) != 0)
+		error = ext2fs_delalloc_reserve(ip, 1, cred);
+	genfs_node_unlock(vp);
+
+	mutex_enter(uobj->vmobjlock);
+	mutex_enter(&uvm_pageqlock);
+	if (error == 0)
+		pg->flags &= ~(PG_RDONLY | PG_CLEAN);
+	uvm_pageactivate(pg);
+	mutex_exit(&uvm_pageqlock);
+	uvm_page_unbusy(&pg, 1);
+	mutex_exit(uobj->vmobjlock);
+	return error;
+}
+
+/*
+ * Allocate the delayed allocation pages in [offlo, offhi), offhi 0
+ * meaning the end of the file, before they are written.
+ */
+int
+ext2fs_delalloc_flush(struct vnode *vp, voff_t offlo, voff_t offhi)
+{
+	struct inode *ip = VTOI(vp);
+	struct m_ext2fs *fs = ip->i_e2fs;
+	daddr_t lbn, end;
+	bool locked;
+	int error = 0;
+
+	locked = genfs_node_wrlocked(vp);
+	if (!locked)
+		genfs_node_wrlock(vp);
+	lbn = ext2_lblkno(fs, offlo);
+	end = ext2_lblkno(fs, ext2_blkroundup(fs, ext2fs_size(ip)));
+	if (offhi != 0)
+		end = MIN(end, ext2_lblkno(fs, ext2_blkroundup(fs, offhi)));
+	if (lbn < end)
+		error = ext2fs_delalloc_scan(vp, lbn, end - lbn, true);
+	if (!locked)
+		genfs_node_unlock(vp);
+	return error;
+}
+
+/*
+ * Give back the reservations of the delayed allocation pages past
+ * length, which a truncation is about to throw away.  The caller holds
+ * the genfs node lock.
+ */
+void
+ext2fs_delalloc_release(struct vnode *vp, off_t length)
+{
+	struct inode *ip = VTOI(vp);
+	struct m_ext2fs *fs = ip->i_e2fs;
+	daddr_t lbn, end;
+
+	KASSERT(genfs_node_wrlocked(vp));
+	lbn = ext2_lblkno(fs, ext2_blkroundup(fs, length));
+	end = ext2_lblkno(fs, ext2_blkroundup(fs, ext2fs_size(ip)));
+	if (lbn < end)
+		(void)ext2fs_delalloc_scan(vp, lbn, end - lbn, false);
+}
+
+/*
+ * genfs_gop_write() that first allocates delayed allocation pages.
+ * The genfs node lock is only tried, since a reader can hold it while
+ * waiting for one of these busy pages; if it is taken the pages are
+ * handed back dirty, to be written later.  The pagedaemon never
+ * allocates: building bitmaps, buddies and the extent cache can sleep
+ * for memory it is trying to free, so it leaves the pages to the syncer.
+ */
+int
+ext2fs_gop_write(struct vnode *vp, struct vm_page **pgs, int npages,
+    int flags)
+{
+	struct inode *ip = VTOI(vp);
+	struct uvm_object *uobj = &vp->v_uobj;
+	bool locked;
+	int i, error;
+
+	if (ip->inode_ext.e2fs.i_ext_cache.ec_ndelalloc == 0)
+		return genfs_gop_write(vp, pgs, npages, flags);
+
+	locked = genfs_node_wrlocked(vp);
+	if (curlwp == uvm.pagedaemon_lwp) {
+		error = EAGAIN;
+	} else if (!locked && !rw_tryenter(&VTOG(vp)->g_glock, RW_WRITER)) {
+		error = EAGAIN;
+	} else {
+		error = ext2fs_delalloc_scan(vp,
+		    pgs[0]->offset >> ip->i_e2fs->e2fs_bshift, npages, true);
+		if (!locked)
+			genfs_node_unlock(vp);
+	}
+	if (error == 0)
+		return genfs_gop_write(vp, pgs, npages, flags);
+
+	mutex_enter(uobj->vmobjlock);
+	mutex_enter(&uvm_pageqlock);
+	for (i = 0; i < npages; i++) {
+		if (pgs[i]->flags & PG_PAGEOUT)
+			uvm_pageout_done(1);
+		pgs[i]->flags &= ~(PG_CLEAN | PG_PAGEOUT | PG_RELEASED);
+		uvm_pageactivate(pgs[i]);
+	}
+	mutex_exit(&uvm_pageqlock);
+	uvm_page_unbusy(pgs, npages);
+	mutex_exit(uobj->vmobjlock);
+	return error;
+}
@@ -82,15 +82,35 @@ __KERNEL_RCSID(0, "$NetBSD: ext2fs_bmap.c,v 1.30 2016/08/14 11:26:35 jdolecek Ex
 #include <ufs/ufs/ufsmount.h>
 #include <ufs/ufs/ufs_extern.h>
 #include <ufs/ext2fs/ext2fs.h>
+#include <ufs/ext2fs/ext2fs_extents.h>
 #include <ufs/ext2fs/ext2fs_extern.h>
 
 
-static int ext4_bmapext(struct vnode *, int32_t, int64_t *, int *, int *);
+static int ext4_bmapext(struct vnode *, daddr_t, daddr_t *, int *, int *);
 static int ext2fs_bmaparray(struct vnode *, daddr_t, daddr_t *, struct indir *,
     int *, int *);
 
 #define	is_sequential(ump, a, b)	((b) == (a) + ump->um_seqinc)
 
+/*
+ * Upper bound in bytes for the contiguous runs bmap reports, and so
+ * for the size of the reads genfs builds from them.  Never more than
+ * MAXPHYS, which is what the device can take in one transfer.
+ */
+int ext2fs_maxcontig = 1024 * 1024;
+
+/*
+ * Largest run, in blocks following the requested one, to report.
+ */
+static int
+ext2fs_maxrun(struct vnode *vp)
+{
+	int maxcontig;
+
+	maxcontig = MIN(MAX(ext2fs_maxcontig, 0), MAXPHYS);
+	return MAX(maxcontig / (int)vp->v_mount->mnt_stat.f_iosize, 1) - 1;
+}
+
 /*
  * Bmap converts a the logical block number of a file to its physical block
  * number on the disk. The conversion is done by using the logical block
@@ -129,18 +149,20 @@ ext2fs_bmap(void *v)
  * on the disk within ext4 extents.
  */
 static int
-ext4_bmapext(struct vnode *vp, int32_t bn, int64_t *bnp, int *runp, int *runb)
+ext4_bmapext(struct vnode *vp, daddr_t bn, daddr_t *bnp, int *runp, int *runb)
 {	
 	struct inode *ip;
 	struct m_ext2fs	 *fs;
 	struct ext4_extent *ep;
 	struct ext4_extent_path path = { .ep_bp = NULL };
+	struct ext4_extent_cache_entry ec;
 	daddr_t lbn;
-	int error = 0;
+	int error = 0, type, maxrun;
 
 	ip = VTOI(vp);
 	fs = ip->i_e2fs;
 	lbn = bn;
+	maxrun = ext2fs_maxrun(vp);
 
 	/* XXX: Should not initialize on error? */
 	if (runp != NULL)
@@ -149,14 +171,38 @@ ext4_bmapext(struct vnode *vp, int32_t bn, int64_t *bnp, int *runp, int *runb)
 	if (runb != NULL)
 		*runb = 0;
 
+	/* nothing can be mapped past 32 bit logical blocks */
+	if (lbn >= EXT4_EXT_LBLK_LIMIT) {
+		*bnp = -1;
+		return 0;
+	}
+
+	type = ext4_ext_in_cache(ip, lbn, &ec);
+	if (type != EXT4_EXT_CACHE_NO) {
+		if (type != EXT4_EXT_CACHE_IN) {
+			/* holes and unwritten extents read as zeroes */
+			*bnp = -1;
+		} else {
+			*bnp = fsbtodb(fs, lbn - ec.ec_blk + ec.ec_start);
+			if (*bnp == 0)
+				*bnp = -1;
+		}
+		if (runp != NULL)
+			*runp = MIN(ec.ec_len - (lbn - ec.ec_blk) - 1, maxrun);
+		if (runb != NULL)
+			*runb = MIN(lbn - ec.ec_blk, maxrun);
+		return 0;
+	}
+
 	ext4_ext_find_extent(fs, ip, lbn, &path);
 	if (path.ep_is_sparse) {
 		*bnp = -1;
 		if (runp != NULL)
-			*runp = path.ep_sparse_ext.e_len -
-			    (lbn - path.ep_sparse_ext.e_blk) - 1;
+			*runp = MIN(path.ep_sparse_ext.e_len -
+			    (lbn - path.ep_sparse_ext.e_blk) - 1, maxrun);
 		if (runb != NULL)
-			*runb = lbn - path.ep_sparse_ext.e_blk;
+			*runb = MIN(lbn - path.ep_sparse_ext.e_blk, maxrun);
+		ext4_ext_put_cache(ip, &path.ep_sparse_ext, EXT4_EXT_CACHE_GAP);
 	} else {
 		if (path.ep_ext == NULL) {
 			error = EIO;
@@ -166,13 +212,16 @@ ext4_bmapext(struct vnode *vp, int32_t bn, int64_t *bnp, int *runp, int *runb)
 		*bnp = fsbtodb(fs, lbn - ep->e_blk
 		    + (ep->e_start_lo | (daddr_t)ep->e_start_hi << 32));
 
-		if (*bnp == 0)
+		if (*bnp == 0 || ext4_ext_is_unwritten(ep))
 			*bnp = -1;
 
 		if (runp != NULL)
-			*runp = ep->e_len - (lbn - ep->e_blk) - 1;
+			*runp = MIN(ext4_ext_get_len(ep) - (lbn - ep->e_blk) - 1,
+			    maxrun);
 		if (runb != NULL)
-			*runb = lbn - ep->e_blk;
+			*runb = MIN(lbn - ep->e_blk, maxrun);
+		ext4_ext_put_cache(ip, ep, ext4_ext_is_unwritten(ep) ?
+		    EXT4_EXT_CACHE_UNWRITTEN : EXT4_EXT_CACHE_IN);
 	}
 
 out:
@@ -221,14 +270,8 @@ ext2fs_bmaparray(struct vnode *vp, daddr_t bn, daddr_t *bnp, struct indir *ap,
 #endif
 
 	if (runp) {
-		/*
-		 * XXX
-		 * If MAXBSIZE is the largest transfer the disks can handle,
-		 * we probably want maxrun to be 1 block less so that we
-		 * don't create a block larger than the device can handle.
-		 */
 		*runp = 0;
-		maxrun = MAXBSIZE / mp->mnt_stat.f_iosize - 1;
+		maxrun = ext2fs_maxrun(vp);
 	}
 
 	if (bn >= 0 && bn < EXT2FS_NDADDR) {
@@ -335,3 +378,126 @@ ext2fs_bmaparray(struct vnode *vp, daddr_t bn, daddr_t *bnp, struct indir *ap,
 	*bnp = daddr == 0 ? -1 : daddr;
 	return 0;
 }
+
+/*
+ * Append the run [lbn, lbn + len) -> pbn to runs, extending the
+ * previous run when it continues it.  Returns false once maxruns runs
+ * are in use and the new one does not fit.
+ */
+bool
+ext2fs_map_add(struct ext2fs_map_run *runs, int maxruns, int *nrunsp,
+    daddr_t lbn, daddr_t pbn, daddr_t len, int flags)
+{
+	struct ext2fs_map_run *mr;
+
+	if (pbn == 0)
+		flags = EXT2FS_MAP_HOLE;
+	if (*nrunsp > 0) {
+		mr = &runs[*nrunsp - 1];
+		if (mr->mr_lbn + mr->mr_len == lbn && mr->mr_flags == flags &&
+		    (pbn == 0 || mr->mr_pbn + mr->mr_len == pbn)) {
+			mr->mr_len += len;
+			return true;
+		}
+	}
+	if (*nrunsp >= maxruns)
+		return false;
+	mr = &runs[(*nrunsp)++];
+	mr->mr_lbn = lbn;
+	mr->mr_pbn = pbn;
+	mr->mr_len = len;
+	mr->mr_flags = flags;
+	return true;
+}
+
+/*
+ * ext2fs_bmap_range() for files using indirect blocks.  Each indirect
+ * block is read once for all the pointers it holds, and a missing
+ * indirect block accounts for its whole subtree at once.
+ */
+static int
+ext2fs_indir_map_range(struct inode *ip, daddr_t lbn, daddr_t count,
+    struct ext2fs_map_run *runs, int maxruns, int *nrunsp)
+{
+	struct vnode *vp = ITOV(ip);
+	struct m_ext2fs *fs = ip->i_e2fs;
+	struct indir a[EXT2FS_NIADDR + 2];
+	struct buf *bp;
+	int32_t *bap;	/* XXX ondisk32 */
+	daddr_t end, daddr, span, off;
+	int num, i, j, k, error;
+
+	end = lbn + count;
+	while (lbn < end) {
+		if (lbn < EXT2FS_NDADDR) {
+			/* XXX ondisk32 */
+			if (!ext2fs_map_add(runs, maxruns, nrunsp, lbn,
+			    fs2h32(ip->i_e2fs_blocks[lbn]), 1, 0))
+				return 0;
+			lbn++;
+			continue;
+		}
+
+		if ((error = ufs_getlbns(vp, lbn, a, &num)) != 0)
+			return error;
+		/* XXX ondisk32 */
+		daddr = fs2h32(ip->i_e2fs_blocks[EXT2FS_NDADDR + a[0].in_off]);
+		for (k = 0;; k++) {
+			if (daddr == 0) {
+				/* blocks left in the subtree of the pointer */
+				for (span = 1, j = k + 1; j < num; j++)
+					span *= EXT2_NINDIR(fs);
+				for (off = 0, j = k + 1; j < num; j++)
+					off = off * EXT2_NINDIR(fs) + a[j].in_off;
+				span = MIN(span - off, end - lbn);
+				if (!ext2fs_map_add(runs, maxruns, nrunsp,
+				    lbn, 0, span, 0))
+					return 0;
+				lbn += span;
+				break;
+			}
+			error = bread(vp, a[k + 1].in_lbn, fs->e2fs_bsize, 0,
+			    &bp);
+			if (error)
+				return error;
+			bap = (int32_t *)bp->b_data;	/* XXX ondisk32 */
+			if (k + 1 < num - 1) {
+				daddr = fs2h32(bap[a[k + 1].in_off]);
+				brelse(bp, 0);
+				continue;
+			}
+			for (i = a[k + 1].in_off;
+			    i < EXT2_NINDIR(fs) && lbn < end; i++, lbn++) {
+				if (!ext2fs_map_add(runs, maxruns, nrunsp,
+				    lbn, fs2h32(bap[i]), 1, 0)) {
+					brelse(bp, 0);
+					return 0;
+				}
+			}
+			brelse(bp, 0);
+			break;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Describe the mapping of count blocks starting at lbn as a list of
+ * runs of holes, unwritten extents and physically contiguous blocks,
+ * with one walk of the extent tree or the indirect blocks.  At most
+ * maxruns runs are returned in *nrunsp; when they do not reach the end
+ * of the range the caller continues after the last one.
+ */
+int
+ext2fs_bmap_range(struct inode *ip, daddr_t lbn, daddr_t count,
+    struct ext2fs_map_run *runs, int maxruns, int *nrunsp)
+{
+
+	*nrunsp = 0;
+	if (lbn < 0 || count < 0 || maxruns <= 0)
+		return EINVAL;
+	if (ip->i_e2fs_flags & EXT2_EXTENTS)
+		return ext4_ext_map_range(ip, lbn, count, runs, maxruns,
+		    nrunsp);
+	return ext2fs_indir_map_range(ip, lbn, count, runs, maxruns, nrunsp);
+}
@@ -43,6 +43,8 @@ __KERNEL_RCSID(0, "$NetBSD: ext2fs_extents.c,v 1.3 2016/08/13 07:40:10 christos
 #include <sys/vnode.h>
 #include <sys/signalvar.h>
 #include <sys/kauth.h>
+#include <sys/kmem.h>
+#include <sys/mutex.h>
 
 #include <ufs/ufs/inode.h>
 #include <ufs/ufs/ufsmount.h>
@@ -54,6 +56,24 @@ __KERNEL_RCSID(0, "$NetBSD: ext2fs_extents.c,v 1.3 2016/08/13 07:40:10 christos
 #include <ufs/ext2fs/ext2fs_extern.h>
 
 
+/*
+ * Describe the hole [start, end] around lbn in path->ep_sparse_ext.
+ * A hole longer than an extent can describe is cut down to the
+ * part that starts at lbn, so lbn always lies inside the result.
+ */
+static void
+ext4_ext_set_sparse(struct ext4_extent_path *path, daddr_t lbn,
+		daddr_t start, daddr_t end)
+{
+
+	if (lbn - start >= EXT4_EXT_SPARSE_MAX)
+		start = lbn;
+	path->ep_sparse_ext.e_blk = start;
+	path->ep_sparse_ext.e_len = MIN(end - start + 1, EXT4_EXT_SPARSE_MAX);
+	path->ep_sparse_ext.e_start_hi = 0;
+	path->ep_sparse_ext.e_start_lo = 0;
+	path->ep_is_sparse = true;
+}
 
 static bool
 ext4_ext_binsearch_index(struct inode *ip, struct ext4_extent_path *path,
@@ -75,11 +95,7 @@ ext4_ext_binsearch_index(struct inode *ip, struct ext4_extent_path *path,
 	}
 
 	if (l == first) {
-		path->ep_sparse_ext.e_blk = *first_lbn;
-		path->ep_sparse_ext.e_len = first->ei_blk - *first_lbn;
-		path->ep_sparse_ext.e_start_hi = 0;
-		path->ep_sparse_ext.e_start_lo = 0;
-		path->ep_is_sparse = true;
+		ext4_ext_set_sparse(path, lbn, *first_lbn, first->ei_blk - 1);
 		return true;
 	}
 	path->ep_index = l - 1;
@@ -95,9 +111,13 @@ ext4_ext_binsearch(struct inode *ip, struct ext4_extent_path *path, daddr_t lbn,
 {
 	struct ext4_extent_header *ehp = path->ep_header;
 	struct ext4_extent *first, *l, *r, *m;
+	daddr_t end;
 
-	if (ehp->eh_ecount == 0)
+	if (ehp->eh_ecount == 0) {
+		/* empty leaf, e.g. a freshly created file */
+		ext4_ext_set_sparse(path, lbn, first_lbn, last_lbn);
 		return;
+	}
 
 	first = (struct ext4_extent *)(char *)(ehp + 1);
 	l = first;
@@ -111,67 +131,267 @@ ext4_ext_binsearch(struct inode *ip, struct ext4_extent_path *path, daddr_t lbn,
 	}
 
 	if (l == first) {
-		path->ep_sparse_ext.e_blk = first_lbn;
-		path->ep_sparse_ext.e_len = first->e_blk - first_lbn;
-		path->ep_sparse_ext.e_start_hi = 0;
-		path->ep_sparse_ext.e_start_lo = 0;
-		path->ep_is_sparse = true;
+		ext4_ext_set_sparse(path, lbn, first_lbn, first->e_blk - 1);
 		return;
 	}
 	path->ep_ext = l - 1;
-	if (path->ep_ext->e_blk + path->ep_ext->e_len <= lbn) {
-		path->ep_sparse_ext.e_blk = path->ep_ext->e_blk +
-		    path->ep_ext->e_len;
-		if (l <= (first + ehp->eh_ecount - 1))
-			path->ep_sparse_ext.e_len = l->e_blk -
-			    path->ep_sparse_ext.e_blk;
+	end = (daddr_t)path->ep_ext->e_blk + ext4_ext_get_len(path->ep_ext);
+	if (end <= lbn) {
+		/* up to the next extent, or to the end of the leaf's range */
+		ext4_ext_set_sparse(path, lbn, end,
+		    l <= first + ehp->eh_ecount - 1 ? l->e_blk - 1 : last_lbn);
+	}
+}
+
+u_int ext4_ext_cache_size = EXT4_EXT_CACHE_DEFSIZE;
+uint64_t ext4_ext_cache_hits;
+uint64_t ext4_ext_cache_misses;
+
+void
+ext4_ext_cache_init(struct inode *ip)
+{
+	struct ext4_extent_cache *ecp = &ip->inode_ext.e2fs.i_ext_cache;
+
+	mutex_init(&ecp->ec_lock, MUTEX_DEFAULT, IPL_NONE);
+	ecp->ec_ent = NULL;
+	ecp->ec_max = ecp->ec_nent = ecp->ec_hand = 0;
+	ecp->ec_cur_leaf = 0;
+	ecp->ec_ndelalloc = 0;
+	ecp->ec_rsv.rsv_start = ecp->ec_rsv.rsv_end = 0;
+	ecp->ec_rsv.rsv_size = EXT2FS_RSV_MIN;
+}
+
+void
+ext4_ext_cache_destroy(struct inode *ip)
+{
+	struct ext4_extent_cache *ecp = &ip->inode_ext.e2fs.i_ext_cache;
+
+	if (ecp->ec_ent != NULL)
+		kmem_free(ecp->ec_ent, ecp->ec_max * sizeof(*ecp->ec_ent));
+	ecp->ec_ent = NULL;
+	mutex_destroy(&ecp->ec_lock);
+}
+
+/*
+ * Forget everything cached for the inode.  Must be called whenever the
+ * extent tree changes.
+ */
+void
+ext4_ext_cache_invalidate(struct inode *ip)
+{
+	struct ext4_extent_cache *ecp = &ip->inode_ext.e2fs.i_ext_cache;
+
+	mutex_enter(&ecp->ec_lock);
+	ecp->ec_nent = ecp->ec_hand = 0;
+	ecp->ec_cur_leaf = 0;
+	mutex_exit(&ecp->ec_lock);
+}
+
+/*
+ * Return index of the last entry starting at or before lbn,
+ * or -1 if there is none.
+ */
+static int
+ext4_ext_cache_search(struct ext4_extent_cache *ecp, daddr_t lbn)
+{
+	int l, r, m;
+
+	l = 0;
+	r = ecp->ec_nent - 1;
+	while (l <= r) {
+		m = l + (r - l) / 2;
+		if (lbn < ecp->ec_ent[m].ec_blk)
+			r = m - 1;
 		else
-			path->ep_sparse_ext.e_len = last_lbn -
-			    path->ep_sparse_ext.e_blk + 1;
-		path->ep_sparse_ext.e_start_hi = 0;
-		path->ep_sparse_ext.e_start_lo = 0;
-		path->ep_is_sparse = true;
+			l = m + 1;
 	}
+	return l - 1;
+}
+
+static void
+ext4_ext_cache_remove(struct ext4_extent_cache *ecp, int first, int last)
+{
+
+	memmove(&ecp->ec_ent[first], &ecp->ec_ent[last],
+	    (ecp->ec_nent - last) * sizeof(*ecp->ec_ent));
+	ecp->ec_nent -= last - first;
+	if (ecp->ec_hand >= ecp->ec_nent)
+		ecp->ec_hand = 0;
+}
+
+/*
+ * Pick an entry to replace using the clock algorithm: entries used
+ * since the hand last passed them get a second chance.
+ */
+static int
+ext4_ext_cache_victim(struct ext4_extent_cache *ecp)
+{
+	struct ext4_extent_cache_entry *ecep;
+	int i;
+
+	for (i = 0; i < 2 * ecp->ec_nent; i++) {
+		ecep = &ecp->ec_ent[ecp->ec_hand];
+		if (ecep->ec_ref == 0)
+			return ecp->ec_hand;
+		ecep->ec_ref = 0;
+		if (++ecp->ec_hand >= ecp->ec_nent)
+			ecp->ec_hand = 0;
+	}
+	return ecp->ec_hand;
 }
 
 /*
  * Find a block in ext4 extent cache.
  */
 int
-ext4_ext_in_cache(struct inode *ip, daddr_t lbn, struct ext4_extent *ep)
+ext4_ext_in_cache(struct inode *ip, daddr_t lbn,
+    struct ext4_extent_cache_entry *ecep)
 {
 	struct ext4_extent_cache *ecp;
-	int ret = EXT4_EXT_CACHE_NO;
+	struct ext4_extent_cache_entry *cur;
+	int i, ret = EXT4_EXT_CACHE_NO;
 
 	ecp = &ip->inode_ext.e2fs.i_ext_cache;
 
-	/* cache is invalid */
-	if (ecp->ec_type == EXT4_EXT_CACHE_NO)
-		return ret;
-
-	if (lbn >= ecp->ec_blk && lbn < ecp->ec_blk + ecp->ec_len) {
-		ep->e_blk = ecp->ec_blk;
-		ep->e_start_lo = ecp->ec_start & 0xffffffff;
-		ep->e_start_hi = ecp->ec_start >> 32 & 0xffff;
-		ep->e_len = ecp->ec_len;
-		ret = ecp->ec_type;
+	mutex_enter(&ecp->ec_lock);
+	i = ext4_ext_cache_search(ecp, lbn);
+	if (i >= 0) {
+		cur = &ecp->ec_ent[i];
+		if (lbn < cur->ec_blk + cur->ec_len) {
+			cur->ec_ref = 1;
+			*ecep = *cur;
+			ret = cur->ec_type;
+		}
 	}
+	mutex_exit(&ecp->ec_lock);
+
+	/* statistics only, races are harmless */
+	if (ret == EXT4_EXT_CACHE_NO)
+		ext4_ext_cache_misses++;
+	else
+		ext4_ext_cache_hits++;
 	return ret;
 }
 
 /*
- * Put an ext4_extent structure in ext4 cache.
+ * Put an ext4_extent structure in ext4 cache.  Entries overlapping
+ * the new one are stale and get dropped.
  */
 void
 ext4_ext_put_cache(struct inode *ip, struct ext4_extent *ep, int type)
 {
 	struct ext4_extent_cache *ecp;
+	struct ext4_extent_cache_entry *ecep;
+	daddr_t blk, end;
+	u_int max;
+	int first, last, victim;
+
+	if (ext4_ext_get_len(ep) == 0)
+		return;
 
 	ecp = &ip->inode_ext.e2fs.i_ext_cache;
-	ecp->ec_type = type;
-	ecp->ec_blk = ep->e_blk;
-	ecp->ec_len = ep->e_len;
-	ecp->ec_start = (daddr_t)ep->e_start_hi << 32 | ep->e_start_lo;
+	blk = ep->e_blk;
+	end = blk + ext4_ext_get_len(ep);
+
+	/* allocate outside of the lock, it may sleep */
+	if (ecp->ec_ent == NULL) {
+		max = MIN(MAX(ext4_ext_cache_size, 1), EXT4_EXT_CACHE_MAXSIZE);
+		ecep = kmem_alloc(max * sizeof(*ecep), KM_SLEEP);
+		mutex_enter(&ecp->ec_lock);
+		if (ecp->ec_ent == NULL) {
+			ecp->ec_ent = ecep;
+			ecp->ec_max = max;
+			ecep = NULL;
+		}
+		mutex_exit(&ecp->ec_lock);
+		if (ecep != NULL)
+			kmem_free(ecep, max * sizeof(*ecep));
+	}
+
+	mutex_enter(&ecp->ec_lock);
+	first = ext4_ext_cache_search(ecp, blk);
+	if (first < 0 || ecp->ec_ent[first].ec_blk +
+	    ecp->ec_ent[first].ec_len <= blk)
+		first++;
+	last = ext4_ext_cache_search(ecp, end - 1) + 1;
+	if (last > first)
+		ext4_ext_cache_remove(ecp, first, last);
+
+	if (ecp->ec_nent == ecp->ec_max) {
+		victim = ext4_ext_cache_victim(ecp);
+		ext4_ext_cache_remove(ecp, victim, victim + 1);
+		if (victim < first)
+			first--;
+	}
+
+	memmove(&ecp->ec_ent[first + 1], &ecp->ec_ent[first],
+	    (ecp->ec_nent - first) * sizeof(*ecp->ec_ent));
+	ecp->ec_nent++;
+	ecep = &ecp->ec_ent[first];
+	ecep->ec_type = type;
+	ecep->ec_ref = 0;
+	ecep->ec_blk = ep->e_blk;
+	ecep->ec_len = ext4_ext_get_len(ep);
+	ecep->ec_start = (daddr_t)ep->e_start_hi << 32 | ep->e_start_lo;
+	mutex_exit(&ecp->ec_lock);
+}
+
+/*
+ * Try to resolve lbn in the leaf remembered by the cursor, without
+ * reading the index blocks above it.  The leaf is only remembered by
+ * block number: a busy buffer cannot be held between lookups, but
+ * rereading it is normally a buffer cache hit.
+ */
+static bool
+ext4_ext_find_cursor(struct m_ext2fs *fs, struct inode *ip,
+		     daddr_t lbn, struct ext4_extent_path *path)
+{
+	struct ext4_extent_cache *ecp = &ip->inode_ext.e2fs.i_ext_cache;
+	struct ext4_extent_header *ehp;
+	daddr_t leaf, first_lbn, last_lbn;
+	struct buf *bp;
+
+	mutex_enter(&ecp->ec_lock);
+	leaf = ecp->ec_cur_leaf;
+	first_lbn = ecp->ec_cur_first;
+	last_lbn = ecp->ec_cur_last;
+	mutex_exit(&ecp->ec_lock);
+
+	if (leaf == 0 || lbn < first_lbn || lbn > last_lbn)
+		return false;
+
+	if (bread(ip->i_devvp, fsbtodb(fs, leaf), fs->e2fs_bsize, 0, &bp))
+		return false;
+	ehp = (struct ext4_extent_header *)bp->b_data;
+	if (ehp->eh_magic != EXT4_EXT_MAGIC || ehp->eh_depth != 0) {
+		brelse(bp, 0);
+		return false;
+	}
+
+	if (path->ep_bp != NULL)
+		brelse(path->ep_bp, 0);
+	path->ep_bp = bp;
+	path->ep_header = ehp;
+	path->ep_depth = 0;
+	path->ep_ext = NULL;
+	path->ep_index = NULL;
+	path->ep_is_sparse = false;
+
+	ext4_ext_binsearch(ip, path, lbn, first_lbn, last_lbn);
+	return true;
+}
+
+static void
+ext4_ext_set_cursor(struct inode *ip, daddr_t leaf, daddr_t first_lbn,
+		    daddr_t last_lbn)
+{
+	struct ext4_extent_cache *ecp = &ip->inode_ext.e2fs.i_ext_cache;
+
+	mutex_enter(&ecp->ec_lock);
+	ecp->ec_cur_leaf = leaf;
+	ecp->ec_cur_first = first_lbn;
+	ecp->ec_cur_last = last_lbn;
+	mutex_exit(&ecp->ec_lock);
 }
 
 /*
@@ -184,17 +404,20 @@ ext4_ext_find_extent(struct m_ext2fs *fs, struct inode *ip,
 	struct ext4_extent_header *ehp;
 	uint16_t i;
 	int error, size;
-	daddr_t nblk;
+	daddr_t nblk = 0;
 
 	ehp = (struct ext4_extent_header *)ip->i_din.e2fs_din->e2di_blocks;
 
 	if (ehp->eh_magic != EXT4_EXT_MAGIC)
 		return NULL;
 
+	if (ehp->eh_depth != 0 && ext4_ext_find_cursor(fs, ip, lbn, path))
+		return path;
+
 	path->ep_header = ehp;
 
 	daddr_t first_lbn = 0;
-	daddr_t last_lbn = lblkno(ip->i_e2fs, ip->i_size);
+	daddr_t last_lbn = EXT4_EXT_LBLK_LIMIT - 1;
 
 	for (i = ehp->eh_depth; i != 0; --i) {
 		path->ep_depth = i;
@@ -227,6 +450,958 @@ ext4_ext_find_extent(struct m_ext2fs *fs, struct inode *ip,
 	path->ep_index = NULL;
 	path->ep_is_sparse = false;
 
+	if (nblk != 0)
+		ext4_ext_set_cursor(ip, nblk, first_lbn, last_lbn);
+
 	ext4_ext_binsearch(ip, path, lbn, first_lbn, last_lbn);
 	return path;
 }
+
+/*
+ * Extent tree modification.
+ *
+ * Unlike lookups, which only need the leaf, updates keep every node
+ * on the path from the root to the leaf busy so that keys can be
+ * adjusted and nodes split.  Level 0 is the root in the inode.
+ */
+struct ext4_ext_wpath {
+	struct buf *wp_bp;		/* NULL for the root */
+	struct ext4_extent_header *wp_hdr;
+	int wp_pos;			/* index followed or insert position */
+	bool wp_dirty;
+};
+
+CTASSERT(sizeof(struct ext4_extent) == sizeof(struct ext4_extent_index));
+
+#define	EXT4_EXT_ROOT_MAX(ip) \
+	((sizeof((ip)->i_e2fs_blocks) - sizeof(struct ext4_extent_header)) / \
+	    sizeof(struct ext4_extent))
+#define	EXT4_EXT_NODE_MAX(fs) \
+	(((fs)->e2fs_bsize - sizeof(struct ext4_extent_header)) / \
+	    sizeof(struct ext4_extent))
+
+/*
+ * Set up an empty extent tree in the inode.
+ */
+void
+ext4_ext_tree_init(struct inode *ip)
+{
+	struct ext4_extent_header *ehp;
+
+	memset(ip->i_e2fs_blocks, 0, sizeof(ip->i_e2fs_blocks));
+	ehp = (struct ext4_extent_header *)ip->i_e2fs_blocks;
+	ehp->eh_magic = EXT4_EXT_MAGIC;
+	ehp->eh_max = EXT4_EXT_ROOT_MAX(ip);
+	ip->i_e2fs_flags |= EXT2_EXTENTS;
+	ip->i_flag |= IN_CHANGE | IN_UPDATE;
+	ext4_ext_cache_invalidate(ip);
+}
+
+static void
+ext4_ext_wpath_put(struct inode *ip, struct ext4_ext_wpath *wp, int depth,
+    int flags)
+{
+	int i;
+
+	if (wp[0].wp_dirty)
+		ip->i_flag |= IN_CHANGE | IN_UPDATE;
+	for (i = 1; i <= depth; i++) {
+		if (wp[i].wp_bp == NULL)
+			continue;
+		if (!wp[i].wp_dirty)
+			brelse(wp[i].wp_bp, 0);
+		else if (flags & B_SYNC)
+			bwrite(wp[i].wp_bp);
+		else
+			bdwrite(wp[i].wp_bp);
+		wp[i].wp_bp = NULL;
+	}
+}
+
+/*
+ * Walk from the root to the leaf that covers lbn, or would cover it
+ * if it were mapped, leaving each node busy.
+ */
+static int
+ext4_ext_wpath_get(struct inode *ip, daddr_t lbn, struct ext4_ext_wpath *wp,
+    int *depthp)
+{
+	struct m_ext2fs *fs = ip->i_e2fs;
+	struct ext4_extent_header *ehp;
+	struct ext4_extent_index *eip;
+	struct ext4_extent *ep;
+	struct buf *bp;
+	int depth, i, l, r, m, error;
+
+	ehp = (struct ext4_extent_header *)ip->i_e2fs_blocks;
+	if (ehp->eh_magic != EXT4_EXT_MAGIC ||
+	    ehp->eh_depth >= EXT4_EXT_MAX_DEPTH)
+		return EIO;
+	depth = ehp->eh_depth;
+	*depthp = depth;
+
+	wp[0].wp_bp = NULL;
+	for (i = 0;; i++) {
+		wp[i].wp_hdr = ehp;
+		wp[i].wp_dirty = false;
+
+		/* number of entries with a key <= lbn */
+		l = 0;
+		r = ehp->eh_ecount;
+		if (i == depth) {
+			ep = EXT4_FIRST_EXTENT(ehp);
+			while (l < r) {
+				m = l + (r - l) / 2;
+				if (lbn < ep[m].e_blk)
+					r = m;
+				else
+					l = m + 1;
+			}
+			wp[i].wp_pos = l;
+			return 0;
+		}
+
+		if (ehp->eh_ecount == 0) {
+			error = EIO;
+			goto fail;
+		}
+		eip = EXT4_FIRST_INDEX(ehp);
+		while (l < r) {
+			m = l + (r - l) / 2;
+			if (lbn < eip[m].ei_blk)
+				r = m;
+			else
+				l = m + 1;
+		}
+		wp[i].wp_pos = l > 0 ? l - 1 : 0;
+
+		error = bread(ip->i_devvp,
+		    EXT2_FSBTODB(fs, ext4_ext_index_leaf(&eip[wp[i].wp_pos])),
+		    fs->e2fs_bsize, B_MODIFY, &bp);
+		if (error)
+			goto fail;
+		ehp = (struct ext4_extent_header *)bp->b_data;
+		wp[i + 1].wp_bp = bp;
+		if (ehp->eh_magic != EXT4_EXT_MAGIC ||
+		    ehp->eh_depth != depth - i - 1 ||
+		    ehp->eh_ecount > ehp->eh_max) {
+			wp[i + 1].wp_dirty = false;
+			i++;
+			error = EIO;
+			goto fail;
+		}
+	}
+
+fail:
+	ext4_ext_wpath_put(ip, wp, i, 0);
+	return error;
+}
+
+/*
+ * The first key of the node at the given level became key; propagate
+ * it to the parents for which this node is the leftmost child.
+ */
+static void
+ext4_ext_fix_keys(struct ext4_ext_wpath *wp, int level, daddr_t key)
+{
+	struct ext4_extent_index *eip;
+	int i;
+
+	for (i = level - 1; i >= 0; i--) {
+		eip = &EXT4_FIRST_INDEX(wp[i].wp_hdr)[wp[i].wp_pos];
+		if (eip->ei_blk == key)
+			break;
+		eip->ei_blk = key;
+		wp[i].wp_dirty = true;
+		if (wp[i].wp_pos != 0)
+			break;
+	}
+}
+
+/*
+ * Allocate and clear a block for a new tree node.  Nodes are placed
+ * near the inode rather than in the middle of the data they map.
+ */
+static int
+ext4_ext_new_node(struct inode *ip, daddr_t lbn, kauth_cred_t cred,
+    daddr_t *nbp, struct buf **bpp)
+{
+	struct m_ext2fs *fs = ip->i_e2fs;
+	struct buf *bp;
+	int error;
+
+	error = ext2fs_alloc(ip, lbn, 0, cred, nbp);
+	if (error)
+		return error;
+	bp = getblk(ip->i_devvp, EXT2_FSBTODB(fs, *nbp), fs->e2fs_bsize, 0, 0);
+	clrbuf(bp);
+	*bpp = bp;
+	return 0;
+}
+
+static void
+ext4_ext_free_blocks(struct inode *ip, daddr_t nb, daddr_t len)
+{
+	struct m_ext2fs *fs = ip->i_e2fs;
+
+	ext2fs_blkfree_range(ip, nb, len);
+	ext2fs_setnblock(ip,
+	    ext2fs_nblock(ip) - (uint64_t)len * btodb(fs->e2fs_bsize));
+	ip->i_flag |= IN_CHANGE | IN_UPDATE;
+}
+
+/*
+ * The root is full: move its contents to a new block and make the root
+ * a single index entry pointing at it.
+ */
+static int
+ext4_ext_grow(struct inode *ip, struct ext4_ext_wpath *wp, daddr_t lbn,
+    kauth_cred_t cred)
+{
+	struct m_ext2fs *fs = ip->i_e2fs;
+	struct ext4_extent_header *root = wp[0].wp_hdr, *nhp;
+	struct ext4_extent_index *eip;
+	struct buf *bp;
+	daddr_t nb, key;
+	int error;
+
+	if (root->eh_depth + 1 >= EXT4_EXT_MAX_DEPTH)
+		return EFBIG;
+	error = ext4_ext_new_node(ip, lbn, cred, &nb, &bp);
+	if (error)
+		return error;
+
+	nhp = (struct ext4_extent_header *)bp->b_data;
+	memcpy(nhp, root, sizeof(*root) +
+	    root->eh_ecount * sizeof(struct ext4_extent));
+	nhp->eh_max = EXT4_EXT_NODE_MAX(fs);
+	if (root->eh_depth == 0)
+		key = EXT4_FIRST_EXTENT(root)->e_blk;
+	else
+		key = EXT4_FIRST_INDEX(root)->ei_blk;
+
+	/* the new node must be on disk before the root points at it */
+	if ((error = bwrite(bp)) != 0) {
+		ext4_ext_free_blocks(ip, nb, 1);
+		return error;
+	}
+
+	root->eh_depth++;
+	root->eh_ecount = 1;
+	eip = EXT4_FIRST_INDEX(root);
+	eip->ei_blk = key;
+	ext4_ext_set_index_leaf(eip, nb);
+	eip->ei_unused = 0;
+	wp[0].wp_dirty = true;
+	return 0;
+}
+
+/*
+ * The node at level is full but its parent has room: move the upper
+ * part of it to a new sibling.  When a new extent is being appended
+ * past its last entry, move as little as possible so that sequentially
+ * written files end up with full nodes.
+ */
+static int
+ext4_ext_split(struct inode *ip, struct ext4_ext_wpath *wp, int level,
+    int depth, daddr_t lbn, bool append, kauth_cred_t cred)
+{
+	struct m_ext2fs *fs = ip->i_e2fs;
+	struct ext4_extent_header *ehp = wp[level].wp_hdr, *nhp, *php;
+	struct ext4_extent_index *eip;
+	struct buf *bp;
+	daddr_t nb, key;
+	int n, keep, moved, ppos, error;
+	bool leaf = level == depth;
+
+	n = ehp->eh_ecount;
+	if (leaf)
+		keep = append && wp[level].wp_pos >= n ? n : n / 2;
+	else
+		keep = wp[level].wp_pos >= n - 1 ? n - 1 : n / 2;
+	moved = n - keep;
+
+	error = ext4_ext_new_node(ip, lbn, cred, &nb, &bp);
+	if (error)
+		return error;
+	nhp = (struct ext4_extent_header *)bp->b_data;
+	nhp->eh_magic = EXT4_EXT_MAGIC;
+	nhp->eh_ecount = moved;
+	nhp->eh_max = EXT4_EXT_NODE_MAX(fs);
+	nhp->eh_depth = ehp->eh_depth;
+	memcpy(EXT4_FIRST_EXTENT(nhp), EXT4_FIRST_EXTENT(ehp) + keep,
+	    moved * sizeof(struct ext4_extent));
+	if (moved == 0)
+		key = lbn;
+	else if (leaf)
+		key = EXT4_FIRST_EXTENT(nhp)->e_blk;
+	else
+		key = EXT4_FIRST_INDEX(nhp)->ei_blk;
+
+	if ((error = bwrite(bp)) != 0) {
+		ext4_ext_free_blocks(ip, nb, 1);
+		return error;
+	}
+
+	ehp->eh_ecount = keep;
+	wp[level].wp_dirty = true;
+
+	php = wp[level - 1].wp_hdr;
+	ppos = wp[level - 1].wp_pos + 1;
+	eip = EXT4_FIRST_INDEX(php);
+	memmove(&eip[ppos + 1], &eip[ppos],
+	    (php->eh_ecount - ppos) * sizeof(*eip));
+	eip[ppos].ei_blk = key;
+	ext4_ext_set_index_leaf(&eip[ppos], nb);
+	eip[ppos].ei_unused = 0;
+	php->eh_ecount++;
+	wp[level - 1].wp_dirty = true;
+	return 0;
+}
+
+static bool
+ext4_ext_can_merge(const struct ext4_extent *l, const struct ext4_extent *r)
+{
+	int llen = ext4_ext_get_len(l), rlen = ext4_ext_get_len(r);
+
+	if (ext4_ext_is_unwritten(l) != ext4_ext_is_unwritten(r))
+		return false;
+	return (daddr_t)l->e_blk + llen == r->e_blk &&
+	    ext4_ext_start(l) + llen == ext4_ext_start(r) &&
+	    llen + rlen <= (ext4_ext_is_unwritten(l) ?
+	    EXT4_EXT_UNWRITTEN_MAX_LEN : EXT4_EXT_INIT_MAX_LEN);
+}
+
+static void
+ext4_ext_add_len(struct ext4_extent *ep, int len)
+{
+
+	ext4_ext_set_len(ep, ext4_ext_get_len(ep) + len,
+	    ext4_ext_is_unwritten(ep));
+}
+
+/*
+ * Split or grow the tree so that the leaf on the path gets free slots.
+ * The caller has to look the path up again afterwards.
+ */
+static int
+ext4_ext_make_room(struct inode *ip, struct ext4_ext_wpath *wp, int depth,
+    daddr_t lbn, bool append, kauth_cred_t cred)
+{
+	int level;
+
+	for (level = depth - 1; level >= 0; level--)
+		if (wp[level].wp_hdr->eh_ecount < wp[level].wp_hdr->eh_max)
+			break;
+	if (level < 0)
+		return ext4_ext_grow(ip, wp, lbn, cred);
+	return ext4_ext_split(ip, wp, level + 1, depth, lbn, append, cred);
+}
+
+/*
+ * Map the unmapped logical range [lbn, lbn + len) to pblk, merging
+ * with neighbouring extents where possible and splitting nodes or
+ * growing the tree when the leaf is full.
+ */
+static int
+ext4_ext_insert(struct inode *ip, daddr_t lbn, daddr_t pblk, int len,
+    bool unwritten, kauth_cred_t cred, int flags)
+{
+	struct ext4_ext_wpath wp[EXT4_EXT_MAX_DEPTH];
+	struct ext4_extent_header *ehp;
+	struct ext4_extent *ep, nex;
+	int depth, pos, error;
+
+	nex.e_blk = lbn;
+	ext4_ext_set_len(&nex, len, unwritten);
+	ext4_ext_set_start(&nex, pblk);
+
+	for (;;) {
+		error = ext4_ext_wpath_get(ip, lbn, wp, &depth);
+		if (error)
+			return error;
+		ehp = wp[depth].wp_hdr;
+		pos = wp[depth].wp_pos;
+		ep = EXT4_FIRST_EXTENT(ehp);
+
+		if (pos > 0 && ext4_ext_can_merge(&ep[pos - 1], &nex)) {
+			ext4_ext_add_len(&ep[pos - 1], len);
+			if (pos < ehp->eh_ecount &&
+			    ext4_ext_can_merge(&ep[pos - 1], &ep[pos])) {
+				ext4_ext_add_len(&ep[pos - 1],
+				    ext4_ext_get_len(&ep[pos]));
+				memmove(&ep[pos], &ep[pos + 1],
+				    (ehp->eh_ecount - pos - 1) * sizeof(*ep));
+				ehp->eh_ecount--;
+			}
+			break;
+		}
+		if (pos < ehp->eh_ecount && ext4_ext_can_merge(&nex, &ep[pos])) {
+			ep[pos].e_blk = lbn;
+			ext4_ext_add_len(&ep[pos], len);
+			ext4_ext_set_start(&ep[pos], pblk);
+			if (pos == 0)
+				ext4_ext_fix_keys(wp, depth, lbn);
+			break;
+		}
+		if (ehp->eh_ecount < ehp->eh_max) {
+			memmove(&ep[pos + 1], &ep[pos],
+			    (ehp->eh_ecount - pos) * sizeof(*ep));
+			ep[pos] = nex;
+			ehp->eh_ecount++;
+			if (pos == 0)
+				ext4_ext_fix_keys(wp, depth, lbn);
+			break;
+		}
+
+		/* make room, one level at a time, and try again */
+		error = ext4_ext_make_room(ip, wp, depth, lbn, true, cred);
+		ext4_ext_wpath_put(ip, wp, depth, flags);
+		if (error)
+			return error;
+	}
+
+	wp[depth].wp_dirty = true;
+	ext4_ext_wpath_put(ip, wp, depth, flags);
+	return 0;
+}
+
+/*
+ * Mark [lbn, lbn + len), which must lie within one unwritten extent,
+ * as written.  The unwritten extent is split around the range, and
+ * the written part is merged into a written neighbour when possible,
+ * so that converting an unwritten extent front to back does not add
+ * any entries.
+ */
+static int
+ext4_ext_convert(struct inode *ip, daddr_t lbn, int len, kauth_cred_t cred,
+    int flags)
+{
+	struct ext4_ext_wpath wp[EXT4_EXT_MAX_DEPTH];
+	struct ext4_extent_header *ehp;
+	struct ext4_extent *ep, *cur, mid, tail;
+	daddr_t start;
+	int depth, i, elen, off, need, error;
+
+	for (;;) {
+		error = ext4_ext_wpath_get(ip, lbn, wp, &depth);
+		if (error)
+			return error;
+		ehp = wp[depth].wp_hdr;
+		ep = EXT4_FIRST_EXTENT(ehp);
+		i = wp[depth].wp_pos - 1;
+		cur = &ep[i];
+		if (i < 0 || !ext4_ext_is_unwritten(cur) ||
+		    lbn + len > (daddr_t)cur->e_blk + ext4_ext_get_len(cur)) {
+			ext4_ext_wpath_put(ip, wp, depth, 0);
+			return EIO;
+		}
+		elen = ext4_ext_get_len(cur);
+		off = lbn - cur->e_blk;
+		start = ext4_ext_start(cur);
+		mid.e_blk = lbn;
+		ext4_ext_set_len(&mid, len, false);
+		ext4_ext_set_start(&mid, start + off);
+
+		if (off == 0 && len == elen)
+			need = 0;
+		else if (off == 0)
+			need = i > 0 && ext4_ext_can_merge(&ep[i - 1], &mid) ?
+			    0 : 1;
+		else if (off + len == elen)
+			need = i + 1 < ehp->eh_ecount &&
+			    ext4_ext_can_merge(&mid, &ep[i + 1]) ? 0 : 1;
+		else
+			need = 2;
+		if (ehp->eh_max - ehp->eh_ecount >= need)
+			break;
+
+		error = ext4_ext_make_room(ip, wp, depth, lbn, false, cred);
+		ext4_ext_wpath_put(ip, wp, depth, flags);
+		if (error)
+			return error;
+	}
+
+	if (off == 0 && len == elen) {
+		ext4_ext_set_len(cur, elen, false);
+		if (i + 1 < ehp->eh_ecount && ext4_ext_can_merge(cur, cur + 1)) {
+			ext4_ext_add_len(cur, ext4_ext_get_len(cur + 1));
+			memmove(cur + 1, cur + 2,
+			    (ehp->eh_ecount - i - 2) * sizeof(*ep));
+			ehp->eh_ecount--;
+		}
+		if (i > 0 && ext4_ext_can_merge(cur - 1, cur)) {
+			ext4_ext_add_len(cur - 1, ext4_ext_get_len(cur));
+			memmove(cur, cur + 1,
+			    (ehp->eh_ecount - i - 1) * sizeof(*ep));
+			ehp->eh_ecount--;
+		}
+	} else if (off == 0) {
+		cur->e_blk += len;
+		ext4_ext_set_start(cur, start + len);
+		ext4_ext_set_len(cur, elen - len, true);
+		if (need == 0) {
+			ext4_ext_add_len(cur - 1, len);
+		} else {
+			memmove(cur + 1, cur,
+			    (ehp->eh_ecount - i) * sizeof(*ep));
+			*cur = mid;
+			ehp->eh_ecount++;
+		}
+	} else if (off + len == elen) {
+		ext4_ext_set_len(cur, off, true);
+		if (need == 0) {
+			cur[1].e_blk = lbn;
+			ext4_ext_set_start(&cur[1], start + off);
+			ext4_ext_add_len(&cur[1], len);
+		} else {
+			memmove(cur + 2, cur + 1,
+			    (ehp->eh_ecount - i - 1) * sizeof(*ep));
+			cur[1] = mid;
+			ehp->eh_ecount++;
+		}
+	} else {
+		tail.e_blk = lbn + len;
+		ext4_ext_set_len(&tail, elen - off - len, true);
+		ext4_ext_set_start(&tail, start + off + len);
+		ext4_ext_set_len(cur, off, true);
+		memmove(cur + 3, cur + 1,
+		    (ehp->eh_ecount - i - 1) * sizeof(*ep));
+		cur[1] = mid;
+		cur[2] = tail;
+		ehp->eh_ecount += 2;
+	}
+
+	wp[depth].wp_dirty = true;
+	ext4_ext_wpath_put(ip, wp, depth, flags);
+	return 0;
+}
+
+/*
+ * ext2fs_balloc() for files mapped by extents.
+ */
+int
+ext4_ext_balloc(struct inode *ip, daddr_t bn, int size,
+    kauth_cred_t cred, struct buf **bpp, int flags)
+{
+	struct m_ext2fs *fs = ip->i_e2fs;
+	struct vnode *vp = ITOV(ip);
+	struct ext4_extent_path path = { .ep_bp = NULL };
+	struct buf *bp;
+	daddr_t lbn, pblk, pref, newb;
+	bool unwritten = false;
+	int error;
+
+	if (bpp != NULL)
+		*bpp = NULL;
+	if (bn >= EXT4_EXT_LBLK_LIMIT)
+		return EFBIG;
+	lbn = bn;
+
+	if (ext4_ext_find_extent(fs, ip, lbn, &path) == NULL)
+		return EIO;
+	pblk = 0;
+	if (!path.ep_is_sparse && path.ep_ext != NULL) {
+		pblk = ext4_ext_start(path.ep_ext) + lbn - path.ep_ext->e_blk;
+		unwritten = ext4_ext_is_unwritten(path.ep_ext);
+	}
+	if (path.ep_bp != NULL)
+		brelse(path.ep_bp, 0);
+
+	if (pblk != 0 && !unwritten) {
+		/*
+		 * the block is already allocated, just read it.
+		 */
+		if (bpp != NULL) {
+			error = bread(vp, bn, fs->e2fs_bsize, B_MODIFY, &bp);
+			if (error)
+				return error;
+			*bpp = bp;
+		}
+		return 0;
+	}
+
+	if (pblk != 0) {
+		/*
+		 * preallocated: the block only has to be marked written,
+		 * its old contents are never exposed.
+		 */
+		error = ext4_ext_convert(ip, lbn, 1, cred, flags);
+		ext4_ext_cache_invalidate(ip);
+		if (error)
+			return error;
+		newb = pblk;
+		flags |= B_CLRBUF;
+	} else {
+		pref = ext2fs_blkpref(ip, lbn, 0, NULL);
+		error = ext2fs_alloc(ip, lbn, pref, cred, &newb);
+		if (error)
+			return error;
+		error = ext4_ext_insert(ip, lbn, newb, 1, false, cred, flags);
+		ext4_ext_cache_invalidate(ip);
+		if (error) {
+			ext4_ext_free_blocks(ip, newb, 1);
+			return error;
+		}
+	}
+	ip->i_e2fs_last_lblk = lbn;
+	ip->i_e2fs_last_blk = newb;
+
+	if (bpp != NULL) {
+		bp = getblk(vp, bn, fs->e2fs_bsize, 0, 0);
+		bp->b_blkno = EXT2_FSBTODB(fs, newb);
+		if (flags & B_CLRBUF)
+			clrbuf(bp);
+		*bpp = bp;
+	}
+	return 0;
+}
+
+/*
+ * Allocate blocks for the holes in [lbn, lbn + count), a contiguous
+ * run at a time, and map them as written or, for preallocation, as
+ * unwritten extents.  Preallocation leaves blocks that are already
+ * mapped alone; otherwise unwritten blocks in the range are converted
+ * to written ones.  No data is written, so the cost is in the bitmaps
+ * and the extent tree only.
+ */
+int
+ext4_ext_alloc_range(struct inode *ip, daddr_t lbn, daddr_t count,
+    bool unwritten, kauth_cred_t cred, int flags)
+{
+	struct m_ext2fs *fs = ip->i_e2fs;
+	struct ext4_extent_path path;
+	daddr_t pref, newb, pblk, n, got;
+	bool hole, conv;
+	int error = 0;
+
+	if (lbn + count > EXT4_EXT_LBLK_LIMIT)
+		return EFBIG;
+	while (count > 0) {
+		path.ep_bp = NULL;
+		if (ext4_ext_find_extent(fs, ip, lbn, &path) == NULL) {
+			error = EIO;
+			break;
+		}
+		hole = true;
+		conv = false;
+		pblk = 0;
+		n = 1;
+		if (path.ep_is_sparse) {
+			n = (daddr_t)path.ep_sparse_ext.e_blk +
+			    path.ep_sparse_ext.e_len - lbn;
+		} else if (path.ep_ext != NULL) {
+			hole = false;
+			conv = !unwritten && ext4_ext_is_unwritten(path.ep_ext);
+			n = ext4_ext_get_len(path.ep_ext) -
+			    (lbn - path.ep_ext->e_blk);
+			pblk = ext4_ext_start(path.ep_ext) + lbn -
+			    path.ep_ext->e_blk;
+		}
+		if (path.ep_bp != NULL)
+			brelse(path.ep_bp, 0);
+		n = MIN(MAX(n, 1), count);
+
+		if (conv) {
+			error = ext4_ext_convert(ip, lbn, n, cred, flags);
+			ext4_ext_cache_invalidate(ip);
+			if (error)
+				break;
+			ip->i_e2fs_last_lblk = lbn + n - 1;
+			ip->i_e2fs_last_blk = pblk + n - 1;
+		} else if (hole) {
+			n = MIN(n, unwritten ?
+			    EXT4_EXT_UNWRITTEN_MAX_LEN : EXT4_EXT_INIT_MAX_LEN);
+			pref = ext2fs_blkpref(ip, lbn, 0, NULL);
+			error = ext2fs_alloc_range(ip, lbn, pref, n, cred,
+			    &newb, &got);
+			if (error)
+				break;
+			error = ext4_ext_insert(ip, lbn, newb, got, unwritten,
+			    cred, flags);
+			ext4_ext_cache_invalidate(ip);
+			if (error) {
+				ext4_ext_free_blocks(ip, newb, got);
+				break;
+			}
+			ip->i_e2fs_last_lblk = lbn + got - 1;
+			ip->i_e2fs_last_blk = newb + got - 1;
+			n = got;
+		}
+		lbn += n;
+		count -= n;
+	}
+	return error;
+}
+
+/*
+ * Release everything mapped at or after logical block first in the
+ * subtree rooted at ehp.  Whole extents are freed as one range and
+ * whole subtrees without looking at the blocks they map, so the cost
+ * follows the number of extents.  Freed blocks go to fl and their
+ * space is added to *countp in DEV_BSIZE units.
+ *
+ * A trimmed node is written synchronously before returning, so no
+ * run it dropped is released while the disk still maps it.  When fl
+ * fills up the walk stops with EAGAIN, every node it changed written
+ * out, for the caller to flush fl and walk again.
+ */
+static int
+ext4_ext_trunc_node(struct inode *ip, struct ext4_extent_header *ehp,
+    daddr_t first, long *countp, struct ext2fs_freelist *fl)
+{
+	struct m_ext2fs *fs = ip->i_e2fs;
+	struct ext4_extent_header *chp;
+	struct ext4_extent_index *eip;
+	struct ext4_extent *ep;
+	struct buf *bp;
+	daddr_t nb;
+	int len, error, berror;
+
+	if (ehp->eh_depth == 0) {
+		while (ehp->eh_ecount > 0) {
+			ep = &EXT4_FIRST_EXTENT(ehp)[ehp->eh_ecount - 1];
+			len = ext4_ext_get_len(ep);
+			if ((daddr_t)ep->e_blk + len <= first)
+				break;
+			if (ext2fs_freelist_full(fl))
+				return EAGAIN;
+			if (ep->e_blk >= first) {
+				ext2fs_freelist_add(fl, ext4_ext_start(ep), len);
+				*countp += btodb((off_t)len << fs->e2fs_bshift);
+				ehp->eh_ecount--;
+				continue;
+			}
+			/* keep the head of a straddling extent */
+			len = (daddr_t)ep->e_blk + len - first;
+			ext2fs_freelist_add(fl,
+			    ext4_ext_start(ep) + first - ep->e_blk, len);
+			*countp += btodb((off_t)len << fs->e2fs_bshift);
+			ext4_ext_set_len(ep, first - ep->e_blk,
+			    ext4_ext_is_unwritten(ep));
+			break;
+		}
+		return 0;
+	}
+
+	while (ehp->eh_ecount > 0) {
+		eip = &EXT4_FIRST_INDEX(ehp)[ehp->eh_ecount - 1];
+		nb = ext4_ext_index_leaf(eip);
+		error = bread(ip->i_devvp, EXT2_FSBTODB(fs, nb),
+		    fs->e2fs_bsize, B_MODIFY, &bp);
+		if (error)
+			return error;
+		chp = (struct ext4_extent_header *)bp->b_data;
+		if (chp->eh_magic != EXT4_EXT_MAGIC ||
+		    chp->eh_depth != ehp->eh_depth - 1) {
+			brelse(bp, 0);
+			return EIO;
+		}
+
+		/* a child whose key is below first is only trimmed */
+		error = ext4_ext_trunc_node(ip, chp,
+		    eip->ei_blk >= first ? 0 : first, countp, fl);
+		if (error == 0 && chp->eh_ecount == 0 &&
+		    ext2fs_freelist_full(fl))
+			error = EAGAIN;
+		if (chp->eh_ecount != 0 || error) {
+			berror = bwrite(bp);
+			return error != 0 ? error : berror;
+		}
+		brelse(bp, BC_INVAL);
+		ext2fs_freelist_add(fl, nb, 1);
+		*countp += btodb(fs->e2fs_bsize);
+		ehp->eh_ecount--;
+		if (eip->ei_blk < first)
+			break;
+	}
+	return 0;
+}
+
+/*
+ * Truncate an extent mapped file so that lastblock is its last
+ * block (-1 to release everything), then pull the remaining tree up
+ * into the inode while it fits.
+ */
+int
+ext4_ext_truncate(struct inode *ip, daddr_t lastblock, long *countp)
+{
+	struct m_ext2fs *fs = ip->i_e2fs;
+	struct ext4_extent_header *root, *chp;
+	struct ext2fs_freelist fl;
+	struct buf *bp;
+	daddr_t nb;
+	int error;
+
+	*countp = 0;
+	root = (struct ext4_extent_header *)ip->i_e2fs_blocks;
+	if (root->eh_magic != EXT4_EXT_MAGIC)
+		return EIO;
+
+	/*
+	 * The tree is cut down in place, so unlike the indirect block
+	 * case the inode cannot be written before the walk.  The walk
+	 * writes the blocks it changes and each flush of the list writes
+	 * the inode first instead; a full list ends a pass of the walk.
+	 */
+	ext2fs_freelist_init(&fl, ip);
+	fl.fl_sync = true;
+	while ((error = ext4_ext_trunc_node(ip, root, lastblock + 1, countp,
+	    &fl)) == EAGAIN)
+		ext2fs_freelist_flush(&fl);
+	ip->i_flag |= IN_CHANGE | IN_UPDATE;
+	ext4_ext_cache_invalidate(ip);
+	if (error) {
+		/* a node may still map the runs on disk, leave them to fsck */
+		fl.fl_nrun = 0;
+		goto out;
+	}
+
+	while (root->eh_depth > 0 && root->eh_ecount <= 1) {
+		if (root->eh_ecount == 0) {
+			root->eh_depth = 0;
+			break;
+		}
+		nb = ext4_ext_index_leaf(EXT4_FIRST_INDEX(root));
+		error = bread(ip->i_devvp, EXT2_FSBTODB(fs, nb),
+		    fs->e2fs_bsize, B_MODIFY, &bp);
+		if (error)
+			goto out;
+		chp = (struct ext4_extent_header *)bp->b_data;
+		if (chp->eh_ecount > root->eh_max) {
+			brelse(bp, 0);
+			break;
+		}
+		memcpy(EXT4_FIRST_EXTENT(root), EXT4_FIRST_EXTENT(chp),
+		    chp->eh_ecount * sizeof(struct ext4_extent));
+		root->eh_ecount = chp->eh_ecount;
+		root->eh_depth = chp->eh_depth;
+		brelse(bp, BC_INVAL);
+		if (ext2fs_freelist_full(&fl))
+			ext2fs_freelist_flush(&fl);
+		ext2fs_freelist_add(&fl, nb, 1);
+		*countp += btodb(fs->e2fs_bsize);
+	}
+out:
+	ext2fs_freelist_flush(&fl);
+	return error;
+}
+
+/*
+ * ext2fs_bmap_range() for extent mapped files.  Each leaf covering
+ * the range is reached with one descent and then scanned in order.
+ */
+int
+ext4_ext_map_range(struct inode *ip, daddr_t lbn, daddr_t count,
+    struct ext2fs_map_run *runs, int maxruns, int *nrunsp)
+{
+	struct m_ext2fs *fs = ip->i_e2fs;
+	struct ext4_extent_header *ehp;
+	struct ext4_extent_index *eip;
+	struct ext4_extent *ep;
+	struct buf *bp;
+	daddr_t end, bound, next, len, start;
+	int depth, l, r, m, i, error;
+
+	end = MIN(lbn + count, EXT4_EXT_LBLK_LIMIT);
+	while (lbn < end) {
+		start = lbn;
+		ehp = (struct ext4_extent_header *)ip->i_e2fs_blocks;
+		if (ehp->eh_magic != EXT4_EXT_MAGIC)
+			return EIO;
+		bound = EXT4_EXT_LBLK_LIMIT;
+		bp = NULL;
+		next = -1;
+
+		for (depth = ehp->eh_depth; depth > 0; depth--) {
+			eip = EXT4_FIRST_INDEX(ehp);
+			l = 0;
+			r = ehp->eh_ecount;
+			while (l < r) {
+				m = l + (r - l) / 2;
+				if (lbn < eip[m].ei_blk)
+					r = m;
+				else
+					l = m + 1;
+			}
+			if (l == 0) {
+				/* nothing mapped before the first key */
+				next = ehp->eh_ecount > 0 ?
+				    MIN(eip[0].ei_blk, bound) : bound;
+				break;
+			}
+			if (l < ehp->eh_ecount)
+				bound = eip[l].ei_blk;
+			if (bp != NULL)
+				brelse(bp, 0);
+			error = bread(ip->i_devvp,
+			    EXT2_FSBTODB(fs, ext4_ext_index_leaf(&eip[l - 1])),
+			    fs->e2fs_bsize, 0, &bp);
+			if (error)
+				return error;
+			ehp = (struct ext4_extent_header *)bp->b_data;
+			if (ehp->eh_magic != EXT4_EXT_MAGIC ||
+			    ehp->eh_depth != depth - 1) {
+				brelse(bp, 0);
+				return EIO;
+			}
+		}
+
+		if (next < 0) {
+			ep = EXT4_FIRST_EXTENT(ehp);
+			l = 0;
+			r = ehp->eh_ecount;
+			while (l < r) {
+				m = l + (r - l) / 2;
+				if (lbn < ep[m].e_blk)
+					r = m;
+				else
+					l = m + 1;
+			}
+			i = l;
+			if (i > 0 &&
+			    lbn < (daddr_t)ep[i - 1].e_blk +
+			    ext4_ext_get_len(&ep[i - 1]))
+				i--;
+			for (; i < ehp->eh_ecount && lbn < end; i++) {
+				if (ep[i].e_blk > lbn) {
+					len = MIN(ep[i].e_blk, end) - lbn;
+					if (!ext2fs_map_add(runs, maxruns,
+					    nrunsp, lbn, 0, len, 0))
+						goto full;
+					lbn += len;
+					if (lbn >= end)
+						break;
+				}
+				len = MIN((daddr_t)ep[i].e_blk +
+				    ext4_ext_get_len(&ep[i]), end) - lbn;
+				if (!ext2fs_map_add(runs, maxruns, nrunsp, lbn,
+				    ext4_ext_start(&ep[i]) + lbn - ep[i].e_blk,
+				    len, ext4_ext_is_unwritten(&ep[i]) ?
+				    EXT2FS_MAP_UNWRITTEN : 0))
+					goto full;
+				lbn += len;
+			}
+			next = bound;
+		}
+
+		/* hole up to the next leaf */
+		if (lbn < end && next > lbn) {
+			len = MIN(next, end) - lbn;
+			if (!ext2fs_map_add(runs, maxruns, nrunsp, lbn, 0, len,
+			    0))
+				goto full;
+			lbn += len;
+		}
+		if (bp != NULL)
+			brelse(bp, 0);
+		if (lbn == start)
+			return EIO;	/* keys out of order */
+	}
+	return 0;
+
+full:
+	if (bp != NULL)
+		brelse(bp, 0);
+	return 0;
+}
@@ -32,6 +32,8 @@
 #define	_UFS_EXT2FS_EXT2FS_EXTENTS_H_
 
 #include <sys/types.h>
+#include <sys/mutex.h>
+#include <sys/rbtree.h>
 #ifndef _KERNEL
 #include <stdbool.h>
 #endif
@@ -42,6 +44,7 @@
 #define	EXT4_EXT_CACHE_NO	0
 #define	EXT4_EXT_CACHE_GAP	1
 #define	EXT4_EXT_CACHE_IN	2
+#define	EXT4_EXT_CACHE_UNWRITTEN 3
 
 /*
  * Ext4 file system extent on disk.
@@ -75,16 +78,122 @@ struct ext4_extent_header {
 	uint32_t eh_gen;	/* generation of extent tree */
 };
 
+#define	EXT4_EXT_MAX_DEPTH	5	/* deepest tree we will walk */
+#define	EXT4_EXT_INIT_MAX_LEN	32768	/* longest initialized extent */
+#define	EXT4_EXT_UNWRITTEN_MAX_LEN (EXT4_EXT_INIT_MAX_LEN - 1)
+#define	EXT4_EXT_SPARSE_MAX	0xffff	/* longest hole a path can describe */
+#define	EXT4_EXT_LBLK_LIMIT	((daddr_t)1 << 32)	/* past the last lbn */
+
+#define	EXT4_FIRST_EXTENT(ehp)	((struct ext4_extent *)((ehp) + 1))
+#define	EXT4_FIRST_INDEX(ehp)	((struct ext4_extent_index *)((ehp) + 1))
+
+static __inline daddr_t
+ext4_ext_start(const struct ext4_extent *ep)
+{
+	return (daddr_t)ep->e_start_hi << 32 | ep->e_start_lo;
+}
+
+static __inline void
+ext4_ext_set_start(struct ext4_extent *ep, daddr_t pblk)
+{
+	ep->e_start_lo = pblk & 0xffffffff;
+	ep->e_start_hi = (pblk >> 32) & 0xffff;
+}
+
+/*
+ * Unwritten extents are allocated but read back as zeroes; they are
+ * marked by an e_len above EXT4_EXT_INIT_MAX_LEN.
+ */
+static __inline bool
+ext4_ext_is_unwritten(const struct ext4_extent *ep)
+{
+	return ep->e_len > EXT4_EXT_INIT_MAX_LEN;
+}
+
+static __inline int
+ext4_ext_get_len(const struct ext4_extent *ep)
+{
+	return ep->e_len <= EXT4_EXT_INIT_MAX_LEN ? ep->e_len :
+	    ep->e_len - EXT4_EXT_INIT_MAX_LEN;
+}
+
+static __inline void
+ext4_ext_set_len(struct ext4_extent *ep, int len, bool unwritten)
+{
+	ep->e_len = unwritten ? len + EXT4_EXT_INIT_MAX_LEN : len;
+}
+
+static __inline daddr_t
+ext4_ext_index_leaf(const struct ext4_extent_index *eip)
+{
+	return (daddr_t)eip->ei_leaf_hi << 32 | eip->ei_leaf_lo;
+}
+
+static __inline void
+ext4_ext_set_index_leaf(struct ext4_extent_index *eip, daddr_t pblk)
+{
+	eip->ei_leaf_lo = pblk & 0xffffffff;
+	eip->ei_leaf_hi = (pblk >> 32) & 0xffff;
+}
+
 /*
  * Save cached extent.
  */
-struct ext4_extent_cache {
+struct ext4_extent_cache_entry {
 	daddr_t	ec_start;	/* extent start */
-	uint32_t ec_blk;	/* logical block */
+	daddr_t	ec_blk;		/* logical block */
 	uint32_t ec_len;
-	uint32_t ec_type;
+	uint16_t ec_type;
+	uint16_t ec_ref;	/* used since the last replacement sweep */
 };
 
+/*
+ * Reservation window: free blocks set aside for an inode's next
+ * allocations, which other inodes place their windows clear of.  The
+ * windows of a file system are kept in a tree, see ext2fs_alloc.c.
+ */
+struct ext2fs_rsv {
+	rb_node_t rsv_node;
+	daddr_t	rsv_start;	/* first block, 0 if there is no window */
+	daddr_t	rsv_end;	/* block after the last */
+	int32_t	rsv_size;	/* size of the next window */
+};
+
+#define	EXT2FS_RSV_MIN	8	/* initial window size, in blocks */
+
+/*
+ * Per-inode cache of extents and holes, embedded in the in-core inode
+ * as i_ext_cache.  Entries are kept sorted by logical block and never
+ * overlap; the array is allocated on first use.
+ */
+struct ext4_extent_cache {
+	kmutex_t ec_lock;
+	struct ext4_extent_cache_entry *ec_ent;
+	uint16_t ec_max;	/* size of ec_ent */
+	uint16_t ec_nent;	/* entries in use */
+	uint16_t ec_hand;	/* clock hand for replacement */
+
+	/*
+	 * Cursor: the leaf reached by the last tree descent and the
+	 * logical range it covers, so nearby lookups go straight to it.
+	 * ec_cur_leaf is 0 when there is no cursor.
+	 */
+	daddr_t	ec_cur_leaf;
+	daddr_t	ec_cur_first;
+	daddr_t	ec_cur_last;
+
+	/*
+	 * Blocks reserved for pages written under delayed allocation
+	 * and not allocated yet, see ext2fs_delalloc_range().
+	 */
+	daddr_t	ec_ndelalloc;
+
+	struct ext2fs_rsv ec_rsv;	/* block reservation window */
+};
+
+#define	EXT4_EXT_CACHE_DEFSIZE	16	/* default entries per inode */
+#define	EXT4_EXT_CACHE_MAXSIZE	256	/* upper bound for the tunable */
+
 /*
  * Save path to some extent.
  */
@@ -100,12 +209,30 @@ struct ext4_extent_path {
 	struct ext4_extent_header *ep_header;
 };
 
+struct buf;
+struct ext2fs_map_run;
 struct inode;
 struct m_ext2fs;
 
-int	ext4_ext_in_cache(struct inode *, daddr_t, struct ext4_extent *);
+extern u_int ext4_ext_cache_size;
+extern uint64_t ext4_ext_cache_hits;
+extern uint64_t ext4_ext_cache_misses;
+
+void	ext4_ext_cache_init(struct inode *);
+void	ext4_ext_cache_destroy(struct inode *);
+void	ext4_ext_cache_invalidate(struct inode *);
+int	ext4_ext_in_cache(struct inode *, daddr_t,
+    struct ext4_extent_cache_entry *);
 void	ext4_ext_put_cache(struct inode *, struct ext4_extent *, int);
 struct ext4_extent_path *ext4_ext_find_extent(struct m_ext2fs *fs,
     struct inode *, daddr_t, struct ext4_extent_path *);
+void	ext4_ext_tree_init(struct inode *);
+int	ext4_ext_balloc(struct inode *, daddr_t, int, kauth_cred_t,
+    struct buf **, int);
+int	ext4_ext_truncate(struct inode *, daddr_t, long *);
+int	ext4_ext_alloc_range(struct inode *, daddr_t, daddr_t, bool,
+    kauth_cred_t, int);
+int	ext4_ext_map_range(struct inode *, daddr_t, daddr_t,
+    struct ext2fs_map_run *, int, int *);
 
 #endif /* !_UFS_EXT2FS_EXT2FS_EXTENTS_H_ */
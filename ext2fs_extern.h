@@ -80,9 +80,19 @@ struct componentname;
 struct ufs_lookup_results;
 struct ext2fs_searchslot;
 struct ext2fs_direct;
+struct ext2fs_map_run;
+struct ext2fs_freelist;
+struct ext2fs_fstrim_range;
+struct vm_page;
 
 extern struct pool ext2fs_inode_pool;		/* memory pool for inodes */
 extern struct pool ext2fs_dinode_pool;		/* memory pool for dinodes */
+extern int ext2fs_maxcontig;			/* longest bmap run in bytes */
+extern int ext2fs_delalloc;			/* delay block allocation */
+extern int ext2fs_rsvmax;			/* largest reservation window */
+extern int ext2fs_bmcache;			/* groups with cached bitmaps */
+extern int ext2fs_buddymax;			/* groups with a buddy */
+extern int ext2fs_itinit_delay;			/* ms between zeroed groups */
 
 #define	EXT2FS_ITIMES(ip, acc, mod, cre) \
 	while ((ip)->i_flag & (IN_ACCESS | IN_CHANGE | IN_UPDATE | IN_MODIFY)) \
@@ -93,22 +103,50 @@ __BEGIN_DECLS
 /* ext2fs_alloc.c */
 int ext2fs_alloc(struct inode *, daddr_t, daddr_t , kauth_cred_t,
 		   daddr_t *);
+int ext2fs_alloc_range(struct inode *, daddr_t, daddr_t, daddr_t,
+		   kauth_cred_t, daddr_t *, daddr_t *);
 int ext2fs_realloccg(struct inode *, daddr_t, daddr_t, int, int ,
 			  kauth_cred_t, struct buf **);
 int ext2fs_valloc(struct vnode *, int, kauth_cred_t, ino_t *);
 /* XXX ondisk32 */
 daddr_t ext2fs_blkpref(struct inode *, daddr_t, int, int32_t *);
 void ext2fs_blkfree(struct inode *, daddr_t);
+void ext2fs_blkfree_range(struct inode *, daddr_t, daddr_t);
+void ext2fs_freelist_init(struct ext2fs_freelist *, struct inode *);
+void ext2fs_freelist_add(struct ext2fs_freelist *, daddr_t, daddr_t);
+void ext2fs_freelist_flush(struct ext2fs_freelist *);
+int ext2fs_discard_init(struct m_ext2fs *, struct vnode *);
+void ext2fs_discard_fini(struct m_ext2fs *);
+int ext2fs_trim(struct vnode *, struct ext2fs_fstrim_range *, kauth_cred_t);
 int ext2fs_vfree(struct vnode *, ino_t, int);
-int ext2fs_cg_verify_and_initialize(struct vnode *, struct m_ext2fs *, int);
+int ext2fs_cg_verify(struct m_ext2fs *);
+int ext2fs_itinit_start(struct m_ext2fs *, struct vnode *);
+void ext2fs_itinit_stop(struct m_ext2fs *);
+void ext2fs_cginfo_init(struct m_ext2fs *);
+void ext2fs_cginfo_invalidate(struct m_ext2fs *);
+void ext2fs_cginfo_destroy(struct m_ext2fs *);
+void ext2fs_rsv_release(struct inode *);
+int64_t ext2fs_count_nbfree(struct m_ext2fs *, int64_t);
+int64_t ext2fs_count_nifree(struct m_ext2fs *, int64_t);
+void ext2fs_count_fold(struct m_ext2fs *);
+int ext2fs_bitmap_flush(struct vnode *, struct m_ext2fs *, int);
 
 /* ext2fs_balloc.c */
 int ext2fs_balloc(struct inode *, daddr_t, int, kauth_cred_t,
 			struct buf **, int);
 int ext2fs_gop_alloc(struct vnode *, off_t, off_t, int, kauth_cred_t);
+int ext2fs_gop_write(struct vnode *, struct vm_page **, int, int);
+int ext2fs_delalloc_range(struct vnode *, off_t, off_t, kauth_cred_t);
+int ext2fs_delalloc_flush(struct vnode *, voff_t, voff_t);
+void ext2fs_delalloc_release(struct vnode *, off_t);
+void ext2fs_delalloc_unreserve(struct inode *, daddr_t);
 
 /* ext2fs_bmap.c */
 int ext2fs_bmap(void *);
+int ext2fs_bmap_range(struct inode *, daddr_t, daddr_t,
+    struct ext2fs_map_run *, int, int *);
+bool ext2fs_map_add(struct ext2fs_map_run *, int, int *, daddr_t, daddr_t,
+    daddr_t, int);
 
 /* ext2fs_inode.c */
 uint64_t ext2fs_size(struct inode *);
@@ -142,6 +180,10 @@ int ext2fs_blkatoff(struct vnode *, off_t, char **, struct buf **);
 void ext2fs_fragacct(struct m_ext2fs *, int, int32_t[], int);
 void ext2fs_itimes(struct inode *, const struct timespec *,
     const struct timespec *, const struct timespec *);
+int32_t ext2fs_bitmap_ffc(const void *, int32_t, int32_t);
+int32_t ext2fs_bitmap_runlen(const void *, int32_t, int32_t, int);
+int32_t ext2fs_bitmap_count(const void *, int32_t);
+void ext2fs_bitmap_set(void *, int32_t, int32_t, int);
 
 /* ext2fs_vfsops.c */
 VFS_PROTOS(ext2fs);
@@ -173,6 +215,10 @@ int ext2fs_rmdir(void *);
 int ext2fs_symlink(void *);
 int ext2fs_readlink(void *);
 int ext2fs_advlock(void *);
+int ext2fs_fallocate(void *);
+int ext2fs_putpages(void *);
+int ext2fs_close(void *);
+int ext2fs_ioctl(void *);
 int ext2fs_fsync(void *);
 int ext2fs_vinit(struct mount *, int (**specops)(void *),
 		      int (**fifoops)(void *), struct vnode **);
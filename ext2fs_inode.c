@@ -75,15 +75,18 @@ __KERNEL_RCSID(0, "$NetBSD: ext2fs_inode.c,v 1.88 2017/05/26 14:34:20 riastradh
 #include <sys/resourcevar.h>
 #include <sys/kauth.h>
 
+#include <miscfs/genfs/genfs_node.h>
+
 #include <ufs/ufs/inode.h>
 #include <ufs/ufs/ufsmount.h>
 #include <ufs/ufs/ufs_extern.h>
 
 #include <ufs/ext2fs/ext2fs.h>
 #include <ufs/ext2fs/ext2fs_extern.h>
+#include <ufs/ext2fs/ext2fs_extents.h>
 
 static int ext2fs_indirtrunc(struct inode *, daddr_t, daddr_t,
-				  daddr_t, int, long *);
+				  daddr_t, int, long *, struct ext2fs_freelist *);
 
 /*
  * These are fortunately the same values; it is likely that there is
@@ -196,6 +199,8 @@ ext2fs_inactive(void *v)
 	struct inode *ip = VTOI(vp);
 	int error = 0;
 
+	ext2fs_rsv_release(ip);
+
 	/* Get rid of inodes related to stale file handles. */
 	if (ip->i_e2fs_mode == 0 || ip->i_e2fs_dtime != 0)
 		goto out;
@@ -293,6 +298,7 @@ ext2fs_truncate(struct vnode *ovp, off_t length, int ioflag,
 	/* XXX ondisk32 */
 	int32_t oldblks[EXT2FS_NDADDR + EXT2FS_NIADDR], newblks[EXT2FS_NDADDR + EXT2FS_NIADDR];
 	struct m_ext2fs *fs;
+	struct ext2fs_freelist fl;
 	int offset, size, level;
 	long count, blocksreleased = 0;
 	int i, nblocks;
@@ -362,8 +368,17 @@ ext2fs_truncate(struct vnode *ovp, off_t length, int ioflag,
 		ubc_zerorange(&ovp->v_uobj, length, size - offset,
 		    UBC_UNMAP_FLAG(ovp));
 	}
+	/*
+	 * Extent mapped files are changed under the genfs node lock,
+	 * which also keeps delayed allocation writeback out.
+	 */
+	if (oip->i_e2fs_flags & EXT2_EXTENTS) {
+		genfs_node_wrlock(ovp);
+		ext2fs_delalloc_release(ovp, length);
+	}
 	(void)ext2fs_setsize(oip, length);
 	uvm_vnp_setsize(ovp, length);
+	ext4_ext_cache_invalidate(oip);
 	/*
 	 * Calculate index into inode's block list of
 	 * last direct and indirect blocks (if any)
@@ -371,6 +386,16 @@ ext2fs_truncate(struct vnode *ovp, off_t length, int ioflag,
 	 * the file is truncated to 0.
 	 */
 	lastblock = ext2_lblkno(fs, length + fs->e2fs_bsize - 1) - 1;
+	if (oip->i_e2fs_flags & EXT2_EXTENTS) {
+		error = vtruncbuf(ovp, lastblock + 1, 0, 0);
+		if (error && !allerror)
+			allerror = error;
+		error = ext4_ext_truncate(oip, lastblock, &blocksreleased);
+		if (error && !allerror)
+			allerror = error;
+		genfs_node_unlock(ovp);
+		goto extdone;
+	}
 	lastiblock[SINGLE] = lastblock - EXT2FS_NDADDR;
 	lastiblock[DOUBLE] = lastiblock[SINGLE] - EXT2_NINDIR(fs);
 	lastiblock[TRIPLE] = lastiblock[DOUBLE] - EXT2_NINDIR(fs) * EXT2_NINDIR(fs);
@@ -418,8 +443,10 @@ ext2fs_truncate(struct vnode *ovp, off_t length, int ioflag,
 		allerror = error;
 
 	/*
-	 * Indirect blocks first.
+	 * Indirect blocks first.  Freed blocks are batched in fl and
+	 * handed back to the bitmaps at done.
 	 */
+	ext2fs_freelist_init(&fl, oip);
 	indir_lbn[SINGLE] = -EXT2FS_NDADDR;
 	indir_lbn[DOUBLE] = indir_lbn[SINGLE] - EXT2_NINDIR(fs) -1;
 	indir_lbn[TRIPLE] = indir_lbn[DOUBLE] - EXT2_NINDIR(fs) * EXT2_NINDIR(fs) - 1;
@@ -428,13 +455,14 @@ ext2fs_truncate(struct vnode *ovp, off_t length, int ioflag,
 		bn = fs2h32(oip->i_e2fs_blocks[EXT2FS_NDADDR + level]);
 		if (bn != 0) {
 			error = ext2fs_indirtrunc(oip, indir_lbn[level],
-			    EXT2_FSBTODB(fs, bn), lastiblock[level], level, &count);
+			    EXT2_FSBTODB(fs, bn), lastiblock[level], level, &count,
+			    &fl);
 			if (error)
 				allerror = error;
 			blocksreleased += count;
 			if (lastiblock[level] < 0) {
 				oip->i_e2fs_blocks[EXT2FS_NDADDR + level] = 0;
-				ext2fs_blkfree(oip, bn);
+				ext2fs_freelist_add(&fl, bn, 1);
 				blocksreleased += nblocks;
 			}
 		}
@@ -451,11 +479,12 @@ ext2fs_truncate(struct vnode *ovp, off_t length, int ioflag,
 		if (bn == 0)
 			continue;
 		oip->i_e2fs_blocks[i] = 0;
-		ext2fs_blkfree(oip, bn);
+		ext2fs_freelist_add(&fl, bn, 1);
 		blocksreleased += btodb(fs->e2fs_bsize);
 	}
 
 done:
+	ext2fs_freelist_flush(&fl);
 #ifdef DIAGNOSTIC
 	for (level = SINGLE; level <= TRIPLE; level++)
 		if (newblks[EXT2FS_NDADDR + level] !=
@@ -469,6 +498,7 @@ done:
 	     !LIST_EMPTY(&ovp->v_dirtyblkhd)))
 		panic("ext2fs_truncate3");
 #endif /* DIAGNOSTIC */
+extdone:
 	/*
 	 * Put back the real size.
 	 */
@@ -486,8 +516,8 @@ update:
 
 /*
  * Release blocks associated with the inode ip and stored in the indirect
- * block bn.  Blocks are free'd in LIFO order up to (but not including)
- * lastbn.  If level is greater than SINGLE, the block is an indirect block
+ * block bn.  Blocks are added to fl in LIFO order up to (but not
+ * including) lastbn.  If level is greater than SINGLE, the block is an indirect block
  * and recursive calls to indirtrunc must be used to cleanse other indirect
  * blocks.
  *
@@ -495,7 +525,7 @@ update:
  */
 static int
 ext2fs_indirtrunc(struct inode *ip, daddr_t lbn, daddr_t dbn, daddr_t lastbn,
-		int level, long *countp)
+		int level, long *countp, struct ext2fs_freelist *fl)
 {
 	int i;
 	struct buf *bp;
@@ -575,12 +605,12 @@ ext2fs_indirtrunc(struct inode *ip, daddr_t lbn, daddr_t dbn, daddr_t lastbn,
 		if (level > SINGLE) {
 			error = ext2fs_indirtrunc(ip, nlbn, EXT2_FSBTODB(fs, nb),
 						   (daddr_t)-1, level - 1,
-						   &blkcount);
+						   &blkcount, fl);
 			if (error)
 				allerror = error;
 			blocksreleased += blkcount;
 		}
-		ext2fs_blkfree(ip, nb);
+		ext2fs_freelist_add(fl, nb, 1);
 		blocksreleased += nblocks;
 	}
 
@@ -593,7 +623,7 @@ ext2fs_indirtrunc(struct inode *ip, daddr_t lbn, daddr_t dbn, daddr_t lastbn,
 		nb = fs2h32(bap[i]);
 		if (nb != 0) {
 			error = ext2fs_indirtrunc(ip, nlbn, EXT2_FSBTODB(fs, nb),
-						   last, level - 1, &blkcount);
+						   last, level - 1, &blkcount, fl);
 			if (error)
 				allerror = error;
 			blocksreleased += blkcount;
@@ -75,11 +75,16 @@ __KERNEL_RCSID(0, "$NetBSD: ext2fs_readwrite.c,v 1.75 2016/08/13 07:40:10 christ
 #include <sys/signalvar.h>
 #include <sys/kauth.h>
 
+#include <miscfs/genfs/genfs_node.h>
+
 #include <ufs/ufs/inode.h>
 #include <ufs/ufs/ufsmount.h>
 #include <ufs/ufs/ufs_extern.h>
 #include <ufs/ext2fs/ext2fs.h>
 #include <ufs/ext2fs/ext2fs_extern.h>
+#include <ufs/ext2fs/ext2fs_extents.h>
+
+#define	EXT2FS_MAXRA	16	/* most blocks ext2fs_bufrd() reads ahead */
 
 static int	ext2fs_post_read_update(struct vnode *, int, int);
 static int	ext2fs_post_write_update(struct vnode *, struct uio *, int,
@@ -156,9 +161,11 @@ ext2fs_bufrd(struct vnode *vp, struct uio *uio, int ioflag, kauth_cred_t cred)
 	struct m_ext2fs *fs;
 	struct buf *bp;
 	off_t bytesinfile;
-	daddr_t lbn, nextlbn;
+	daddr_t lbn, nextlbn, bn;
+	daddr_t rablks[EXT2FS_MAXRA];
+	int rasizes[EXT2FS_MAXRA];
 	long size, xfersize, blkoffset;
-	int error;
+	int error, run, nra, i;
 
 	KASSERT(uio->uio_rw == UIO_READ);
 	KASSERT(VOP_ISLOCKED(vp));
@@ -195,13 +202,28 @@ ext2fs_bufrd(struct vnode *vp, struct uio *uio, int ioflag, kauth_cred_t cred)
 		if (bytesinfile < xfersize)
 			xfersize = bytesinfile;
 
-		if (ext2_lblktosize(fs, nextlbn) >= ext2fs_size(ip))
-			error = bread(vp, lbn, size, 0, &bp);
-		else {
-			int nextsize = fs->e2fs_bsize;
-			error = breadn(vp, lbn,
-				size, &nextlbn, &nextsize, 1, 0, &bp);
+		/*
+		 * Read ahead the rest of the physically contiguous run
+		 * this block starts, within the file.  The run stops at
+		 * holes and is bounded by the vfs.ext2fs.maxcontig limit.
+		 */
+		nra = 0;
+		if (ext2_lblktosize(fs, nextlbn) < ext2fs_size(ip) &&
+		    VOP_BMAP(vp, lbn, NULL, &bn, &run) == 0 && bn != -1) {
+			nra = MIN(run, EXT2FS_MAXRA);
+			nra = MIN(nra, ext2_lblkno(fs,
+			    ext2fs_size(ip) + fs->e2fs_bsize - 1) - nextlbn);
+			nra = MAX(nra, 1);
+			for (i = 0; i < nra; i++) {
+				rablks[i] = nextlbn + i;
+				rasizes[i] = fs->e2fs_bsize;
+			}
 		}
+		if (nra == 0)
+			error = bread(vp, lbn, size, 0, &bp);
+		else
+			error = breadn(vp, lbn, size, rablks, rasizes, nra, 0,
+			    &bp);
 		if (error)
 			break;
 
@@ -269,8 +291,9 @@ ext2fs_write(void *v)
 	off_t osize;
 	int blkoffset, error, ioflag, resid;
 	vsize_t bytelen;
+	daddr_t lbn, count;
 	off_t oldoff = 0;					/* XXX */
-	bool async;
+	bool async, delalloc;
 	int extended = 0;
 	int advice;
 
@@ -299,9 +322,31 @@ ext2fs_write(void *v)
 		return 0;
 
 	async = vp->v_mount->mnt_flag & MNT_ASYNC;
+	delalloc = ext2fs_delalloc && (ip->i_e2fs_flags & EXT2_EXTENTS) &&
+	    fs->e2fs_bsize == PAGE_SIZE;
 	resid = uio->uio_resid;
 	osize = ext2fs_size(ip);
 
+	/*
+	 * Blocks past EOF that the write covers completely are given
+	 * out as one range here, so that ufs_balloc_range() below finds
+	 * them mapped and a large write does not allocate block by
+	 * block.  On error the truncate back to osize releases them.
+	 */
+	if (!delalloc && (ip->i_e2fs_flags & EXT2_EXTENTS)) {
+		lbn = ext2_lblkno(fs,
+		    ext2_blkroundup(fs, MAX(osize, uio->uio_offset)));
+		count = ext2_lblkno(fs, uio->uio_offset + uio->uio_resid) - lbn;
+		if (count > 0) {
+			genfs_node_wrlock(vp);
+			error = ext4_ext_alloc_range(ip, lbn, count, false,
+			    ap->a_cred, 0);
+			genfs_node_unlock(vp);
+			if (error)
+				goto out;
+		}
+	}
+
 	KASSERT(vp->v_type == VREG);
 	while (uio->uio_resid > 0) {
 		oldoff = uio->uio_offset;
@@ -311,8 +356,12 @@ ext2fs_write(void *v)
 		if (vp->v_size < oldoff + bytelen) {
 			uvm_vnp_setwritesize(vp, oldoff + bytelen);
 		}
-		error = ufs_balloc_range(vp, uio->uio_offset, bytelen,
-		    ap->a_cred, 0);
+		if (delalloc)
+			error = ext2fs_delalloc_range(vp, uio->uio_offset,
+			    bytelen, ap->a_cred);
+		else
+			error = ufs_balloc_range(vp, uio->uio_offset, bytelen,
+			    ap->a_cred, 0);
 		if (error)
 			break;
 		error = ubc_uiomove(&vp->v_uobj, uio, bytelen, advice,
@@ -333,9 +382,12 @@ ext2fs_write(void *v)
 		/*
 		 * flush what we just wrote if necessary.
 		 * XXXUBC simplistic async flushing.
+		 * Delayed allocation leaves it to the syncer, so that
+		 * blocks are allocated in bigger runs.
 		 */
 
-		if (!async && oldoff >> 16 != uio->uio_offset >> 16) {
+		if (!async && !delalloc &&
+		    oldoff >> 16 != uio->uio_offset >> 16) {
 			mutex_enter(vp->v_interlock);
 			error = VOP_PUTPAGES(vp, (oldoff >> 16) << 16,
 			    (uio->uio_offset >> 16) << 16,
@@ -349,6 +401,7 @@ ext2fs_write(void *v)
 		    PGO_CLEANIT | PGO_SYNCIO);
 	}
 
+out:
 	error = ext2fs_post_write_update(vp, uio, ioflag, ap->a_cred, osize,
 	    resid, extended, error);
 	return error;
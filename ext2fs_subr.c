@@ -64,6 +64,8 @@ __KERNEL_RCSID(0, "$NetBSD: ext2fs_subr.c,v 1.33 2016/08/13 07:40:10 christos Ex
 
 #include <sys/param.h>
 #include <sys/systm.h>
+#include <sys/bitops.h>
+#include <sys/endian.h>
 #include <sys/vnode.h>
 #include <sys/buf.h>
 #include <sys/inttypes.h>
@@ -134,3 +136,97 @@ ext2fs_itimes(struct inode *ip, const struct timespec *acc,
 		ip->i_flag |= IN_MODIFIED;
 	ip->i_flag &= ~(IN_ACCESS | IN_CHANGE | IN_UPDATE | IN_MODIFY);
 }
+
+/*
+ * Block and inode bitmaps.
+ *
+ * On disk, bit i of a bitmap is bit i % 8 of byte i / 8, so a little
+ * endian load of 64 bits gives bits i .. i + 63 in order.  Bitmaps are
+ * whole file system blocks, so the word holding the last bit of a group
+ * can always be read.  A set bit is in use.
+ */
+#define	BM_WORD(map, i)	le64toh(((const uint64_t *)(map))[(i) >> 6])
+
+/*
+ * Find the first clear bit from bit from up to bit n; -1 if none.
+ */
+int32_t
+ext2fs_bitmap_ffc(const void *map, int32_t from, int32_t n)
+{
+	uint64_t w;
+	int32_t i;
+
+	for (i = from; i < n; i = (i | 63) + 1) {
+		w = ~BM_WORD(map, i) >> (i & 63);
+		if (w != 0) {
+			i += ffs64(w) - 1;
+			return i < n ? i : -1;
+		}
+	}
+	return -1;
+}
+
+/*
+ * Count the bits equal to isset starting at bit start, up to max.
+ */
+int32_t
+ext2fs_bitmap_runlen(const void *map, int32_t start, int32_t max, int isset)
+{
+	uint64_t w;
+	int32_t i, n;
+
+	for (n = 0; n < max; ) {
+		i = start + n;
+		w = BM_WORD(map, i);
+		if (isset)
+			w = ~w;
+		w >>= i & 63;
+		if (w != 0) {
+			n += ffs64(w) - 1;
+			break;
+		}
+		n += 64 - (i & 63);
+	}
+	return MIN(n, max);
+}
+
+/*
+ * Count the clear bits among the first n.
+ */
+int32_t
+ext2fs_bitmap_count(const void *map, int32_t n)
+{
+	int32_t i, c;
+
+	for (c = 0, i = 0; i + 64 <= n; i += 64)
+		c += popcount64(~BM_WORD(map, i));
+	if (i < n)
+		c += popcount64(~BM_WORD(map, i) & (((uint64_t)1 << (n - i)) - 1));
+	return c;
+}
+
+/*
+ * Set, or clear, len bits starting at bit start.
+ */
+void
+ext2fs_bitmap_set(void *map, int32_t start, int32_t len, int isset)
+{
+	u_char *p = map;
+	int32_t end, nb;
+
+	end = start + len;
+	for (; start < end && (start & (NBBY - 1)) != 0; start++) {
+		if (isset)
+			setbit(p, start);
+		else
+			clrbit(p, start);
+	}
+	nb = (end - start) / NBBY;
+	memset(&p[start / NBBY], isset ? 0xff : 0, nb);
+	for (start += nb * NBBY; start < end; start++) {
+		if (isset)
+			setbit(p, start);
+		else
+			clrbit(p, start);
+	}
+}
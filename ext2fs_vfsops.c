@@ -99,12 +99,14 @@ __KERNEL_RCSID(0, "$NetBSD: ext2fs_vfsops.c,v 1.209 2017/05/28 16:38:55 hannken
 
 #include <ufs/ext2fs/ext2fs.h>
 #include <ufs/ext2fs/ext2fs_dir.h>
+#include <ufs/ext2fs/ext2fs_extents.h>
 #include <ufs/ext2fs/ext2fs_extern.h>
 
 MODULE(MODULE_CLASS_VFS, ext2fs, "ffs");
 
 int ext2fs_sbupdate(struct ufsmount *, int);
 static int ext2fs_sbfill(struct m_ext2fs *, int);
+static int ext2fs_cg_read(struct vnode *, struct m_ext2fs *);
 
 static struct sysctllog *ext2fs_sysctl_log;
 
@@ -150,7 +152,7 @@ struct vfsops ext2fs_vfsops = {
 static const struct genfs_ops ext2fs_genfsops = {
 	.gop_size = genfs_size,
 	.gop_alloc = ext2fs_gop_alloc,
-	.gop_write = genfs_gop_write,
+	.gop_write = ext2fs_gop_write,
 	.gop_markupdate = ufs_gop_markupdate,
 };
 
@@ -195,6 +197,66 @@ ext2fs_modcmd(modcmd_t cmd, void *arg)
 		 * one more instance of the "number to vfs" mapping problem,
 		 * but "17" is the order as taken from sys/mount.h
 		 */
+		sysctl_createv(&ext2fs_sysctl_log, 0, NULL, NULL,
+			       CTLFLAG_PERMANENT|CTLFLAG_READWRITE,
+			       CTLTYPE_INT, "extent_cache_size",
+			       SYSCTL_DESCR("Extents and holes cached per inode"),
+			       NULL, 0, &ext4_ext_cache_size, 0,
+			       CTL_VFS, 17, CTL_CREATE, CTL_EOL);
+		sysctl_createv(&ext2fs_sysctl_log, 0, NULL, NULL,
+			       CTLFLAG_PERMANENT|CTLFLAG_READONLY,
+			       CTLTYPE_QUAD, "extent_cache_hits",
+			       SYSCTL_DESCR("Extent lookups served from cache"),
+			       NULL, 0, &ext4_ext_cache_hits, 0,
+			       CTL_VFS, 17, CTL_CREATE, CTL_EOL);
+		sysctl_createv(&ext2fs_sysctl_log, 0, NULL, NULL,
+			       CTLFLAG_PERMANENT|CTLFLAG_READONLY,
+			       CTLTYPE_QUAD, "extent_cache_misses",
+			       SYSCTL_DESCR("Extent lookups that walked the tree"),
+			       NULL, 0, &ext4_ext_cache_misses, 0,
+			       CTL_VFS, 17, CTL_CREATE, CTL_EOL);
+		sysctl_createv(&ext2fs_sysctl_log, 0, NULL, NULL,
+			       CTLFLAG_PERMANENT|CTLFLAG_READWRITE,
+			       CTLTYPE_INT, "maxcontig",
+			       SYSCTL_DESCR("Largest contiguous read in bytes, "
+			           "capped at MAXPHYS"),
+			       NULL, 0, &ext2fs_maxcontig, 0,
+			       CTL_VFS, 17, CTL_CREATE, CTL_EOL);
+		sysctl_createv(&ext2fs_sysctl_log, 0, NULL, NULL,
+			       CTLFLAG_PERMANENT|CTLFLAG_READWRITE,
+			       CTLTYPE_INT, "delalloc",
+			       SYSCTL_DESCR("Allocate blocks of extent mapped "
+			           "files at writeback rather than at write"),
+			       NULL, 0, &ext2fs_delalloc, 0,
+			       CTL_VFS, 17, CTL_CREATE, CTL_EOL);
+		sysctl_createv(&ext2fs_sysctl_log, 0, NULL, NULL,
+			       CTLFLAG_PERMANENT|CTLFLAG_READWRITE,
+			       CTLTYPE_INT, "rsvwindow",
+			       SYSCTL_DESCR("Largest block reservation window "
+			           "of a file, 0 to not reserve"),
+			       NULL, 0, &ext2fs_rsvmax, 0,
+			       CTL_VFS, 17, CTL_CREATE, CTL_EOL);
+		sysctl_createv(&ext2fs_sysctl_log, 0, NULL, NULL,
+			       CTLFLAG_PERMANENT|CTLFLAG_READWRITE,
+			       CTLTYPE_INT, "bitmapcache",
+			       SYSCTL_DESCR("Block groups per mount whose "
+			           "bitmaps are kept in memory"),
+			       NULL, 0, &ext2fs_bmcache, 0,
+			       CTL_VFS, 17, CTL_CREATE, CTL_EOL);
+		sysctl_createv(&ext2fs_sysctl_log, 0, NULL, NULL,
+			       CTLFLAG_PERMANENT|CTLFLAG_READWRITE,
+			       CTLTYPE_INT, "buddycache",
+			       SYSCTL_DESCR("Block groups per mount whose "
+			           "buddy is kept, 0 for no limit"),
+			       NULL, 0, &ext2fs_buddymax, 0,
+			       CTL_VFS, 17, CTL_CREATE, CTL_EOL);
+		sysctl_createv(&ext2fs_sysctl_log, 0, NULL, NULL,
+			       CTLFLAG_PERMANENT|CTLFLAG_READWRITE,
+			       CTLTYPE_INT, "itinitdelay",
+			       SYSCTL_DESCR("Pause in ms of the inode table "
+			           "zeroing thread after each group"),
+			       NULL, 0, &ext2fs_itinit_delay, 0,
+			       CTL_VFS, 17, CTL_CREATE, CTL_EOL);
 		break;
 	case MODULE_CMD_FINI:
 		error = vfs_detach(&ext2fs_vfsops);
@@ -442,6 +504,10 @@ ext2fs_mount(struct mount *mp, const char *path, void *data, size_t *data_len)
 			if (mp->mnt_flag & MNT_FORCE)
 				flags |= FORCECLOSE;
 			error = ext2fs_flushfiles(mp, flags);
+			if (error == 0) {
+				ext2fs_itinit_stop(fs);
+				ext2fs_discard_fini(fs);
+			}
 			if (error == 0 &&
 			    ext2fs_cgupdate(ump, MNT_WAIT) == 0 &&
 			    (fs->e2fs.e2fs_state & E2FS_ERRORS) == 0) {
@@ -470,6 +536,19 @@ ext2fs_mount(struct mount *mp, const char *path, void *data, size_t *data_len)
 				fs->e2fs.e2fs_state = E2FS_ERRORS;
 			fs->e2fs_fmod = 1;
 		}
+
+		/*
+		 * Online discard can be turned on by an update; it is only
+		 * turned off with the switch to read-only, as is the inode
+		 * table zeroing.
+		 */
+		if (fs->e2fs_ronly == 0) {
+			error = ext2fs_itinit_start(fs, ump->um_devvp);
+			if (error == 0 && (mp->mnt_flag & MNT_DISCARD))
+				error = ext2fs_discard_init(fs, ump->um_devvp);
+			if (error)
+				return error;
+		}
 		if (args->fspec == NULL)
 			return 0;
 	}
@@ -549,7 +628,7 @@ ext2fs_reload(struct mount *mp, kauth_cred_t cred, struct lwp *l)
 	struct buf *bp;
 	struct m_ext2fs *fs;
 	struct ext2fs *newfs;
-	int i, error;
+	int error;
 	struct ufsmount *ump;
 	struct vnode_iterator *marker;
 
@@ -587,19 +666,10 @@ ext2fs_reload(struct mount *mp, kauth_cred_t cred, struct lwp *l)
 	/*
 	 * Step 3: re-read summary information from disk.
 	 */
-	for (i = 0; i < fs->e2fs_ngdb; i++) {
-		error = bread(devvp ,
-		    EXT2_FSBTODB(fs, fs->e2fs.e2fs_first_dblock +
-		    1 /* superblock */ + i),
-		    fs->e2fs_bsize, 0, &bp);
-		if (error) {
-			return error;
-		}
-		e2fs_cgload((struct ext2_gd *)bp->b_data,
-		    &fs->e2fs_gd[i * fs->e2fs_bsize / sizeof(struct ext2_gd)],
-		    fs->e2fs_bsize);
-		brelse(bp, 0);
-	}
+	error = ext2fs_cg_read(devvp, fs);
+	if (error)
+		return error;
+	ext2fs_cginfo_invalidate(fs);
 
 	vfs_vnode_iterator_init(mp, &marker);
 	while ((vp = vfs_vnode_iterator_next(marker, NULL, NULL))) {
@@ -633,6 +703,7 @@ ext2fs_reload(struct mount *mp, kauth_cred_t cred, struct lwp *l)
 			vput(vp);
 			break;
 		}
+		ext4_ext_cache_invalidate(ip);
 
 		vput(vp);
 	}
@@ -640,6 +711,65 @@ ext2fs_reload(struct mount *mp, kauth_cred_t cred, struct lwp *l)
 	return error;
 }
 
+/*
+ * Largest file size the on-disk format allows: extents hold 32 bit
+ * logical block numbers, indirect files end with the triple indirect
+ * block, and without huge_file i_blocks counts 512 byte sectors in
+ * 32 bits.
+ */
+static uint64_t
+ext2fs_maxfilesize(struct m_ext2fs *fs)
+{
+	uint64_t nindir = EXT2_NINDIR(fs), maxblks, maxsize;
+
+	if (EXT2F_HAS_INCOMPAT_FEATURE(fs, EXT2F_INCOMPAT_EXTENTS))
+		maxblks = EXT4_EXT_LBLK_LIMIT;
+	else
+		maxblks = EXT2FS_NDADDR + nindir + nindir * nindir +
+		    nindir * nindir * nindir;
+	maxsize = maxblks << fs->e2fs_bshift;
+	if (!EXT2F_HAS_ROCOMPAT_FEATURE(fs, EXT2F_ROCOMPAT_HUGE_FILE))
+		maxsize = MIN(maxsize, (uint64_t)0xffffffff << DEV_BSHIFT);
+	return maxsize - 1;
+}
+
+/*
+ * Read the group descriptors into fs->e2fs_gd.  Reads of the next
+ * EXT2FS_GD_RA blocks are kept in flight ahead of the one waited for,
+ * so that the device sees them together rather than one at a time.
+ */
+#define	EXT2FS_GD_RA	32
+
+static int
+ext2fs_cg_read(struct vnode *devvp, struct m_ext2fs *fs)
+{
+	daddr_t rablks[EXT2FS_GD_RA];
+	int rasizes[EXT2FS_GD_RA];
+	struct buf *bp;
+	int i, n, ra, error;
+
+#define	GDBLK(i)	EXT2_FSBTODB(fs, fs->e2fs.e2fs_first_dblock + \
+			    1 /* superblock */ + (i))
+
+	for (i = 0, ra = 1; i < fs->e2fs_ngdb; i++) {
+		for (n = 0; ra < fs->e2fs_ngdb && ra <= i + EXT2FS_GD_RA;
+		    n++, ra++) {
+			rablks[n] = GDBLK(ra);
+			rasizes[n] = fs->e2fs_bsize;
+		}
+		error = breadn(devvp, GDBLK(i), fs->e2fs_bsize, rablks,
+		    rasizes, n, 0, &bp);
+		if (error)
+			return error;
+		e2fs_cgload((struct ext2_gd *)bp->b_data,
+		    &fs->e2fs_gd[i * fs->e2fs_bsize / sizeof(struct ext2_gd)],
+		    fs->e2fs_bsize);
+		brelse(bp, 0);
+	}
+#undef GDBLK
+	return 0;
+}
+
 /*
  * Common code for mount and mountroot
  */
@@ -652,7 +782,7 @@ ext2fs_mountfs(struct vnode *devvp, struct mount *mp)
 	struct ext2fs *fs;
 	struct m_ext2fs *m_fs;
 	dev_t dev;
-	int error, i, ronly;
+	int error, ronly;
 	kauth_cred_t cred;
 
 	dev = devvp->v_rdev;
@@ -704,30 +834,20 @@ ext2fs_mountfs(struct vnode *devvp, struct mount *mp)
 
 	/* XXX: should be added in ext2fs_sbfill()? */
 	m_fs->e2fs_gd = kmem_alloc(m_fs->e2fs_ngdb * m_fs->e2fs_bsize, KM_SLEEP);
-	for (i = 0; i < m_fs->e2fs_ngdb; i++) {
-		error = bread(devvp,
-		    EXT2_FSBTODB(m_fs, m_fs->e2fs.e2fs_first_dblock +
-		    1 /* superblock */ + i),
-		    m_fs->e2fs_bsize, 0, &bp);
-		if (error) {
-			kmem_free(m_fs->e2fs_gd,
-			    m_fs->e2fs_ngdb * m_fs->e2fs_bsize);
-			goto out;
-		}
-		e2fs_cgload((struct ext2_gd *)bp->b_data,
-		    &m_fs->e2fs_gd[
-			i * m_fs->e2fs_bsize / sizeof(struct ext2_gd)],
-		    m_fs->e2fs_bsize);
-		brelse(bp, 0);
-		bp = NULL;
+	error = ext2fs_cg_read(devvp, m_fs);
+	if (error) {
+		kmem_free(m_fs->e2fs_gd, m_fs->e2fs_ngdb * m_fs->e2fs_bsize);
+		goto out;
 	}
 
-	error = ext2fs_cg_verify_and_initialize(devvp, m_fs, ronly);
+	error = ext2fs_cg_verify(m_fs);
 	if (error) {
 		kmem_free(m_fs->e2fs_gd, m_fs->e2fs_ngdb * m_fs->e2fs_bsize);
 		goto out;
 	}
 
+	ext2fs_cginfo_init(m_fs);
+
 	mp->mnt_data = ump;
 	mp->mnt_stat.f_fsidx.__fsid_val[0] = (long)dev;
 	mp->mnt_stat.f_fsidx.__fsid_val[1] = makefstype(MOUNT_EXT2FS);
@@ -747,7 +867,21 @@ ext2fs_mountfs(struct vnode *devvp, struct mount *mp)
 	ump->um_seqinc = 1; /* no frags */
 	ump->um_maxsymlinklen = EXT2_MAXSYMLINKLEN;
 	ump->um_dirblksiz = m_fs->e2fs_bsize;
-	ump->um_maxfilesize = ((uint64_t)0x80000000 * m_fs->e2fs_bsize - 1);
+	ump->um_maxfilesize = ext2fs_maxfilesize(m_fs);
+	if (!ronly) {
+		error = ext2fs_itinit_start(m_fs, devvp);
+		if (error == 0 && (mp->mnt_flag & MNT_DISCARD)) {
+			error = ext2fs_discard_init(m_fs, devvp);
+			if (error)
+				ext2fs_itinit_stop(m_fs);
+		}
+		if (error) {
+			ext2fs_cginfo_destroy(m_fs);
+			kmem_free(m_fs->e2fs_gd,
+			    m_fs->e2fs_ngdb * m_fs->e2fs_bsize);
+			goto out;
+		}
+	}
 	spec_node_setmountedfs(devvp, mp);
 	return 0;
 
@@ -779,6 +913,8 @@ ext2fs_unmount(struct mount *mp, int mntflags)
 		return error;
 	ump = VFSTOUFS(mp);
 	fs = ump->um_e2fs;
+	ext2fs_itinit_stop(fs);
+	ext2fs_discard_fini(fs);
 	if (fs->e2fs_ronly == 0 &&
 		ext2fs_cgupdate(ump, MNT_WAIT) == 0 &&
 		(fs->e2fs.e2fs_state & E2FS_ERRORS) == 0) {
@@ -791,6 +927,7 @@ ext2fs_unmount(struct mount *mp, int mntflags)
 	error = VOP_CLOSE(ump->um_devvp, fs->e2fs_ronly ? FREAD : FREAD|FWRITE,
 	    NOCRED);
 	vput(ump->um_devvp);
+	ext2fs_cginfo_destroy(fs);
 	kmem_free(fs->e2fs_gd, fs->e2fs_ngdb * fs->e2fs_bsize);
 	kmem_free(fs, sizeof(*fs));
 	kmem_free(ump, sizeof(*ump));
@@ -864,15 +1001,16 @@ ext2fs_statvfs(struct mount *mp, struct statvfs *sbp)
 	sbp->f_frsize = MINBSIZE << fs->e2fs.e2fs_fsize;
 	sbp->f_iosize = fs->e2fs_bsize;
 	sbp->f_blocks = fs->e2fs.e2fs_bcount - overhead;
-	sbp->f_bfree = fs->e2fs.e2fs_fbcount;
+	/* space reserved by delayed allocation is as good as used */
+	sbp->f_bfree = ext2fs_count_nbfree(fs, INT64_MAX) - fs->e2fs_dablocks;
 	sbp->f_bresvd = fs->e2fs.e2fs_rbcount;
 	if (sbp->f_bfree > sbp->f_bresvd)
 		sbp->f_bavail = sbp->f_bfree - sbp->f_bresvd;
 	else
 		sbp->f_bavail = 0;
 	sbp->f_files =  fs->e2fs.e2fs_icount;
-	sbp->f_ffree = fs->e2fs.e2fs_ficount;
-	sbp->f_favail = fs->e2fs.e2fs_ficount;
+	sbp->f_ffree = ext2fs_count_nifree(fs, INT64_MAX);
+	sbp->f_favail = sbp->f_ffree;
 	sbp->f_fresvd = 0;
 	copy_statvfs_info(sbp, mp);
 	return 0;
@@ -995,10 +1133,12 @@ ext2fs_init_vnode(struct ufsmount *ump, struct vnode *vp, ino_t ino)
 	ip->i_number = ino;
 	ip->i_e2fs_last_lblk = 0;
 	ip->i_e2fs_last_blk = 0;
+	ext4_ext_cache_init(ip);
 
 	error = ext2fs_loadvnode_content(fs, ino, bp, ip);
 	brelse(bp, 0);
 	if (error) {
+		ext4_ext_cache_destroy(ip);
 		pool_put(&ext2fs_inode_pool, ip);
 		return error;
 	}
@@ -1143,6 +1283,11 @@ ext2fs_newvnode(struct mount *mp, struct vnode *dvp, struct vnode *vp,
 	vp->v_type = IFTOVT(mode);
 	ip->i_e2fs_nlink = 1;
 
+	/* New regular files are mapped by extents when the fs allows it */
+	if (vp->v_type == VREG &&
+	    EXT2F_HAS_INCOMPAT_FEATURE(fs, EXT2F_INCOMPAT_EXTENTS))
+		ext4_ext_tree_init(ip);
+
 	/* Authorize setting SGID if needed. */
 	if (ip->i_e2fs_mode & ISGID) {
 		error = kauth_authorize_vnode(cred, KAUTH_VNODE_WRITE_SECURITY,
@@ -1253,6 +1398,8 @@ ext2fs_sbupdate(struct ufsmount *mp, int waitfor)
 	struct buf *bp;
 	int error = 0;
 
+	if (fs->e2fs_pcpu != NULL)
+		ext2fs_count_fold(fs);
 	bp = getblk(mp->um_devvp, SBLOCK, SBSIZE, 0, 0);
 	e2fs_sbsave(&fs->e2fs, (struct ext2fs*)bp->b_data);
 	if (waitfor == MNT_WAIT)
@@ -1269,7 +1416,10 @@ ext2fs_cgupdate(struct ufsmount *mp, int waitfor)
 	struct buf *bp;
 	int i, error = 0, allerror = 0;
 
-	allerror = ext2fs_sbupdate(mp, waitfor);
+	allerror = ext2fs_bitmap_flush(mp->um_devvp, fs, waitfor);
+	error = ext2fs_sbupdate(mp, waitfor);
+	if (!allerror)
+		allerror = error;
 	for (i = 0; i < fs->e2fs_ngdb; i++) {
 		bp = getblk(mp->um_devvp, EXT2_FSBTODB(fs,
 		    fs->e2fs.e2fs_first_dblock +
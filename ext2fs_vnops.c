@@ -72,6 +72,7 @@ __KERNEL_RCSID(0, "$NetBSD: ext2fs_vnops.c,v 1.128 2017/05/28 16:38:55 hannken E
 #include <sys/resourcevar.h>
 #include <sys/kernel.h>
 #include <sys/file.h>
+#include <sys/filio.h>
 #include <sys/stat.h>
 #include <sys/buf.h>
 #include <sys/proc.h>
@@ -85,14 +86,18 @@ __KERNEL_RCSID(0, "$NetBSD: ext2fs_vnops.c,v 1.128 2017/05/28 16:38:55 hannken E
 
 #include <miscfs/fifofs/fifo.h>
 #include <miscfs/genfs/genfs.h>
+#include <miscfs/genfs/genfs_node.h>
 #include <miscfs/specfs/specdev.h>
 
+#include <uvm/uvm.h>
+
 #include <ufs/ufs/inode.h>
 #include <ufs/ufs/ufs_extern.h>
 #include <ufs/ufs/ufsmount.h>
 
 #include <ufs/ext2fs/ext2fs.h>
 #include <ufs/ext2fs/ext2fs_extern.h>
+#include <ufs/ext2fs/ext2fs_extents.h>
 #include <ufs/ext2fs/ext2fs_dir.h>
 #include <ufs/ext2fs/ext2fs_xattr.h>
 
@@ -928,6 +933,291 @@ ext2fs_advlock(void *v)
 	return lf_advlock(ap, &ip->i_lockf, ext2fs_size(ip));
 }
 
+/*
+ * Emit one FIEMAP entry, or only count it when the caller passed no
+ * array.
+ */
+static int
+ext2fs_fiemap_put(struct ext2fs_fiemap *fm, struct m_ext2fs *fs,
+    const struct ext2fs_map_run *mr, daddr_t lastlbn, uint32_t *nmappedp)
+{
+	struct ext2fs_fiemap_extent fe;
+	int error;
+
+	if (fm->fm_extent_count != 0) {
+		if (*nmappedp >= fm->fm_extent_count)
+			return EJUSTRETURN;
+		memset(&fe, 0, sizeof(fe));
+		fe.fe_logical = ext2_lblktosize(fs, (uint64_t)mr->mr_lbn);
+		fe.fe_physical = ext2_lblktosize(fs, (uint64_t)mr->mr_pbn);
+		fe.fe_length = ext2_lblktosize(fs, (uint64_t)mr->mr_len);
+		if (mr->mr_flags & EXT2FS_MAP_HOLE)
+			fe.fe_flags |= EXT2FS_FIEMAP_EXTENT_HOLE;
+		if (mr->mr_flags & EXT2FS_MAP_UNWRITTEN)
+			fe.fe_flags |= EXT2FS_FIEMAP_EXTENT_UNWRITTEN;
+		if (mr->mr_lbn + mr->mr_len >= lastlbn)
+			fe.fe_flags |= EXT2FS_FIEMAP_EXTENT_LAST;
+		error = copyout(&fe, &fm->fm_extents[*nmappedp], sizeof(fe));
+		if (error)
+			return error;
+	}
+	(*nmappedp)++;
+	return 0;
+}
+
+/*
+ * Report the layout of a byte range of the file.  The mapping is
+ * fetched in batches with the vnode locked, and copied out unlocked.
+ * A run cut by a batch boundary is carried over to the next batch, so
+ * it is still reported as a single entry.
+ */
+static int
+ext2fs_fiemap(struct vnode *vp, struct ext2fs_fiemap *fm)
+{
+	struct ext2fs_map_run runs[16], cur;
+	struct inode *ip = VTOI(vp);
+	struct m_ext2fs *fs = ip->i_e2fs;
+	daddr_t lbn, endlbn, lastlbn;
+	uint64_t size, end;
+	uint32_t nmapped = 0;
+	bool have = false;
+	int i, n, error = 0;
+
+	if (vp->v_type != VREG && vp->v_type != VDIR)
+		return EINVAL;
+	if (fm->fm_flags != 0)
+		return EINVAL;
+
+	vn_lock(vp, LK_SHARED | LK_RETRY);
+	size = ext2fs_size(ip);
+	/* pages under delayed allocation have no blocks to report yet */
+	if (ip->inode_ext.e2fs.i_ext_cache.ec_ndelalloc != 0)
+		error = ext2fs_delalloc_flush(vp, 0, 0);
+	VOP_UNLOCK(vp);
+	if (error)
+		return error;
+
+	lastlbn = ext2_lblkno(fs, size + fs->e2fs_bsize - 1);
+	end = fm->fm_start + fm->fm_length;
+	if (end < fm->fm_start || end > size)
+		end = size;
+	lbn = ext2_lblkno(fs, fm->fm_start);
+	endlbn = ext2_lblkno(fs, end + fs->e2fs_bsize - 1);
+
+	while (lbn < endlbn) {
+		vn_lock(vp, LK_SHARED | LK_RETRY);
+		error = ext2fs_bmap_range(ip, lbn, endlbn - lbn, runs,
+		    __arraycount(runs), &n);
+		VOP_UNLOCK(vp);
+		if (error || n == 0)
+			break;
+		for (i = 0; i < n; i++) {
+			if (have && cur.mr_flags == runs[i].mr_flags &&
+			    cur.mr_lbn + cur.mr_len == runs[i].mr_lbn &&
+			    (cur.mr_pbn == 0 ||
+			     cur.mr_pbn + cur.mr_len == runs[i].mr_pbn)) {
+				cur.mr_len += runs[i].mr_len;
+				continue;
+			}
+			if (have) {
+				error = ext2fs_fiemap_put(fm, fs, &cur,
+				    lastlbn, &nmapped);
+				if (error)
+					goto out;
+			}
+			cur = runs[i];
+			have = true;
+		}
+		lbn = runs[n - 1].mr_lbn + runs[n - 1].mr_len;
+	}
+	if (have && error == 0)
+		error = ext2fs_fiemap_put(fm, fs, &cur, lastlbn, &nmapped);
+out:
+	if (error == EJUSTRETURN)
+		error = 0;
+	fm->fm_mapped_extents = nmapped;
+	return error;
+}
+
+/*
+ * FIOSEEKDATA/FIOSEEKHOLE: move *offp to the next byte of data or of a
+ * hole at or after it, answering from the block map alone.  Unwritten
+ * extents count as holes, and there is always a hole at EOF.
+ */
+static int
+ext2fs_seekdatahole(struct vnode *vp, off_t *offp, bool data)
+{
+	struct ext2fs_map_run runs[16];
+	struct inode *ip = VTOI(vp);
+	struct m_ext2fs *fs = ip->i_e2fs;
+	daddr_t lbn, lastlbn;
+	off_t off = *offp, size;
+	bool hole;
+	int i, n, error = 0;
+
+	if (vp->v_type != VREG)
+		return ENOTTY;
+
+	vn_lock(vp, LK_SHARED | LK_RETRY);
+	size = ext2fs_size(ip);
+	if (off < 0 || off >= size) {
+		error = ENXIO;
+		goto out;
+	}
+	if (ip->inode_ext.e2fs.i_ext_cache.ec_ndelalloc != 0 &&
+	    (error = ext2fs_delalloc_flush(vp, 0, 0)) != 0)
+		goto out;
+	lastlbn = ext2_lblkno(fs, size + fs->e2fs_bsize - 1);
+	for (lbn = ext2_lblkno(fs, off); lbn < lastlbn;) {
+		error = ext2fs_bmap_range(ip, lbn, lastlbn - lbn, runs,
+		    __arraycount(runs), &n);
+		if (error || n == 0)
+			goto out;
+		for (i = 0; i < n; i++) {
+			hole = (runs[i].mr_flags &
+			    (EXT2FS_MAP_HOLE | EXT2FS_MAP_UNWRITTEN)) != 0;
+			if (hole != data) {
+				*offp = MAX(off,
+				    ext2_lblktosize(fs, (off_t)runs[i].mr_lbn));
+				goto out;
+			}
+		}
+		lbn = runs[n - 1].mr_lbn + runs[n - 1].mr_len;
+	}
+	if (data)
+		error = ENXIO;
+	else
+		*offp = size;
+out:
+	VOP_UNLOCK(vp);
+	return error;
+}
+
+int
+ext2fs_ioctl(void *v)
+{
+	struct vop_ioctl_args /* {
+		struct vnode *a_vp;
+		u_long a_command;
+		void *a_data;
+		int a_fflag;
+		kauth_cred_t a_cred;
+	} */ *ap = v;
+
+	switch (ap->a_command) {
+	case EXT2FS_IOC_FIEMAP:
+		return ext2fs_fiemap(ap->a_vp, ap->a_data);
+	case EXT2FS_IOC_FITRIM:
+		return ext2fs_trim(ap->a_vp, ap->a_data, ap->a_cred);
+	case FIOSEEKDATA:
+		return ext2fs_seekdatahole(ap->a_vp, ap->a_data, true);
+	case FIOSEEKHOLE:
+		return ext2fs_seekdatahole(ap->a_vp, ap->a_data, false);
+	default:
+		return ufs_ioctl(v);
+	}
+}
+
+/*
+ * Preallocate space.  Only extent mapped files can record blocks as
+ * allocated but unwritten, so others are left to the caller.
+ */
+int
+ext2fs_fallocate(void *v)
+{
+	struct vop_fallocate_args /* {
+		struct vnode *a_vp;
+		off_t a_pos;
+		off_t a_len;
+	} */ *ap = v;
+	struct vnode *vp = ap->a_vp;
+	struct inode *ip = VTOI(vp);
+	struct m_ext2fs *fs = ip->i_e2fs;
+	off_t end;
+	daddr_t lbn;
+	int error;
+
+	if (vp->v_type != VREG || (ip->i_e2fs_flags & EXT2_EXTENTS) == 0)
+		return EOPNOTSUPP;
+	if (ap->a_pos < 0 || ap->a_len <= 0)
+		return EINVAL;
+	end = ap->a_pos + ap->a_len;
+	if (end < ap->a_pos || end > ip->i_ump->um_maxfilesize)
+		return EFBIG;
+
+	lbn = ext2_lblkno(fs, ap->a_pos);
+	genfs_node_wrlock(vp);
+	/* give pages under delayed allocation their blocks first */
+	error = ext2fs_delalloc_flush(vp, ap->a_pos, end);
+	if (error == 0)
+		error = ext4_ext_alloc_range(ip, lbn,
+		    ext2_lblkno(fs, end - 1) - lbn + 1, true,
+		    kauth_cred_get(), 0);
+	genfs_node_unlock(vp);
+	if (error == 0 && end > ext2fs_size(ip)) {
+		error = ext2fs_setsize(ip, end);
+		uvm_vnp_setsize(vp, end);
+	}
+	ip->i_flag |= IN_CHANGE;
+	return error;
+}
+
+/*
+ * Close called.  The last writer gives up the reservation window.
+ */
+int
+ext2fs_close(void *v)
+{
+	struct vop_close_args /* {
+		struct vnode *a_vp;
+		int  a_fflag;
+		kauth_cred_t a_cred;
+	} */ *ap = v;
+	struct vnode *vp = ap->a_vp;
+
+	if ((ap->a_fflag & FWRITE) != 0 && vp->v_type == VREG &&
+	    vp->v_writecount == 0)
+		ext2fs_rsv_release(VTOI(vp));
+	return ufs_close(v);
+}
+
+/*
+ * Pages under delayed allocation get their blocks here, where the genfs
+ * node lock can be waited for, before genfs writes them.  The pagedaemon
+ * must not wait; ext2fs_gop_write() copes with its pages.
+ */
+int
+ext2fs_putpages(void *v)
+{
+	struct vop_putpages_args /* {
+		struct vnode *a_vp;
+		voff_t a_offlo;
+		voff_t a_offhi;
+		int a_flags;
+	} */ *ap = v;
+	struct vnode *vp = ap->a_vp;
+	struct inode *ip = VTOI(vp);
+	int error;
+
+	if ((ap->a_flags & PGO_CLEANIT) == 0 || ip == NULL ||
+	    curlwp == uvm.pagedaemon_lwp)
+		return genfs_putpages(v);
+	for (;;) {
+		if (ip->inode_ext.e2fs.i_ext_cache.ec_ndelalloc == 0)
+			return genfs_putpages(v);
+		mutex_exit(vp->v_interlock);
+		error = ext2fs_delalloc_flush(vp, ap->a_offlo, ap->a_offhi);
+		if (error)
+			return error;
+		mutex_enter(vp->v_interlock);
+		error = genfs_putpages(v);
+		/* ext2fs_gop_write() found the lock taken, try again */
+		if (error != EAGAIN)
+			return error;
+		mutex_enter(vp->v_interlock);
+	}
+}
+
 int
 ext2fs_fsync(void *v)
 {
@@ -1084,6 +1374,9 @@ ext2fs_reclaim(void *v)
 		return error;
 	if (ip->i_din.e2fs_din != NULL)
 		kmem_free(ip->i_din.e2fs_din, EXT2_DINODE_SIZE(ip->i_e2fs));
+	ext2fs_delalloc_unreserve(ip, ip->inode_ext.e2fs.i_ext_cache.ec_ndelalloc);
+	ext2fs_rsv_release(ip);
+	ext4_ext_cache_destroy(ip);
 	genfs_node_destroy(vp);
 	pool_put(&ext2fs_inode_pool, vp->v_data);
 	vp->v_data = NULL;
@@ -1098,15 +1391,15 @@ const struct vnodeopv_entry_desc ext2fs_vnodeop_entries[] = {
 	{ &vop_create_desc, ext2fs_create },		/* create */
 	{ &vop_mknod_desc, ext2fs_mknod },		/* mknod */
 	{ &vop_open_desc, ext2fs_open },		/* open */
-	{ &vop_close_desc, ufs_close },			/* close */
+	{ &vop_close_desc, ext2fs_close },		/* close */
 	{ &vop_access_desc, ext2fs_access },		/* access */
 	{ &vop_getattr_desc, ext2fs_getattr },		/* getattr */
 	{ &vop_setattr_desc, ext2fs_setattr },		/* setattr */
 	{ &vop_read_desc, ext2fs_read },		/* read */
 	{ &vop_write_desc, ext2fs_write },		/* write */
-	{ &vop_fallocate_desc, genfs_eopnotsupp },	/* fallocate */
+	{ &vop_fallocate_desc, ext2fs_fallocate },	/* fallocate */
 	{ &vop_fdiscard_desc, genfs_eopnotsupp },	/* fdiscard */
-	{ &vop_ioctl_desc, ufs_ioctl },			/* ioctl */
+	{ &vop_ioctl_desc, ext2fs_ioctl },		/* ioctl */
 	{ &vop_fcntl_desc, ufs_fcntl },			/* fcntl */
 	{ &vop_poll_desc, ufs_poll },			/* poll */
 	{ &vop_kqfilter_desc, genfs_kqfilter },		/* kqfilter */
@@ -1135,7 +1428,7 @@ const struct vnodeopv_entry_desc ext2fs_vnodeop_entries[] = {
 	{ &vop_advlock_desc, ext2fs_advlock },		/* advlock */
 	{ &vop_bwrite_desc, vn_bwrite },		/* bwrite */
 	{ &vop_getpages_desc, genfs_getpages },		/* getpages */
-	{ &vop_putpages_desc, genfs_putpages },		/* putpages */
+	{ &vop_putpages_desc, ext2fs_putpages },	/* putpages */
 	{ &vop_getextattr_desc, ext2fs_getextattr },	/* getextattr */
 	{ &vop_setextattr_desc, ext2fs_setextattr },	/* setextattr */
 	{ &vop_listextattr_desc, ext2fs_listextattr },	/* listextattr */